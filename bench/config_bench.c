@@ -0,0 +1,211 @@
+/*
+	Config parser benchmark - compares the single-pass parser with
+	the POSIX regex based one it replaced, on generated configs.
+
+	Build and run with: make bench
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <regex.h>
+
+// The parser's internals are static
+#include "../src/config_parser.c"
+
+/**
+	Regex based line parser, as it was before the single-pass one
+*/
+static const char *midi_ctl_regex_str = "^\\s*([0-9]*)?\\s*(\\[(.*)\\])?\\s*(.*)$";
+static const char *metadata_regex_str = "\\s*([a-zA-z]+)\\s*=\\s*(-?[0-9]+)\\s*,?";
+static const char *hrule_regex_str = "^\\s*---+\\s*(.*)";
+static regex_t midi_ctl_regex, metadata_regex, hrule_regex;
+
+static int regex_parse_metadata(midi_ctl_desc *ctl, const char *metadata)
+{
+	regmatch_t matches[3];
+	int offset = 0;
+	int fail = 0;
+	int cnt = 0;
+
+	while (!fail)
+	{
+		const char *str = metadata + offset;
+		if (regexec(&metadata_regex, str, 3, matches, 0))
+			break;
+
+		if (matches[1].rm_so < 0 || matches[2].rm_so < 0)
+		{
+			fail = 1;
+			break;
+		}
+
+		char *key = strndup(str + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
+		int value = atoi(str + matches[2].rm_so);
+
+		if (!strcmp(key, "cc"))
+			ctl->cc = value;
+		else if (!strcmp(key, "min"))
+			ctl->min = value;
+		else if (!strcmp(key, "max"))
+			ctl->max = value;
+		else if (!strcmp(key, "def"))
+			ctl->def = value;
+		else if (!strcmp(key, "chan"))
+			ctl->channel = value;
+		else if (!strcmp(key, "slider"))
+			ctl->slider = value != 0;
+		else if (!strcmp(key, "update"))
+			ctl->update = value != 0;
+		else
+			fail = 1;
+
+		free(key);
+		offset += matches[0].rm_eo;
+		cnt++;
+	}
+
+	return fail || cnt == 0;
+}
+
+static int regex_parse_line(midi_ctl_desc *ctl, char *line, char **text)
+{
+	regmatch_t matches[16];
+
+	// Comments and trailing whitespace had to be removed first
+	line[strcspn(line, "#")] = 0;
+	trim_r_whitespace(line);
+	line += strspn(line, " \t");
+	if (isempty(line))
+		return 0;
+
+	if (!regexec(&hrule_regex, line, 16, matches, 0))
+	{
+		*text = strndup(line + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
+		return 1;
+	}
+
+	if (regexec(&midi_ctl_regex, line, 16, matches, 0))
+		return -1;
+
+	ctl->cc = -1;
+	ctl->min = 0;
+	ctl->max = 127;
+	ctl->channel = -1;
+	ctl->def = -1;
+	ctl->slider = 1;
+	ctl->update = 0;
+
+	if (matches[1].rm_so >= 0)
+		sscanf(line + matches[1].rm_so, "%d", &ctl->cc);
+
+	if (matches[3].rm_so >= 0)
+	{
+		char *metadata = strndup(line + matches[3].rm_so, matches[3].rm_eo - matches[3].rm_so);
+		int err = regex_parse_metadata(ctl, metadata);
+		free(metadata);
+		if (err)
+			return -1;
+	}
+
+	*text = strndup(line + matches[4].rm_so, matches[4].rm_eo - matches[4].rm_so);
+	return 1;
+}
+
+/**
+	Generates a config with n lines covering all of the syntax
+*/
+static char *generate_config(int n, size_t *size)
+{
+	char *buf = NULL;
+	FILE *f = open_memstream(&buf, size);
+	for (int i = 0; i < n; i++)
+	{
+		switch (i % 8)
+		{
+			case 0: fprintf(f, "--- Section %d\n", i / 8); break;
+			case 1: fprintf(f, "%d Cutoff %d\n", i % 128, i); break;
+			case 2: fprintf(f, "%d [min = 0, max = 100, chan = %d] Resonance # Comment\n", i % 128, i % 16); break;
+			case 3: fprintf(f, "  [cc = %d, def = 64, update = 1] Attack\n", i % 128); break;
+			case 4: fprintf(f, "%d [slider = 0] Waveform %d\n", i % 128, i % 4); break;
+			case 5: fprintf(f, "\n"); break;
+			case 6: fprintf(f, "# Just a comment\n"); break;
+			case 7: fprintf(f, "%d\t[def=10,max=20]\tRelease\t\n", i % 128); break;
+		}
+	}
+	fclose(f);
+	return buf;
+}
+
+typedef int (*bench_fn)(char *line, strpool *labels);
+
+static int bench_single_pass(char *line, strpool *labels)
+{
+	menu_entry ent;
+	midi_ctl_desc ctl;
+	long label;
+	const char *errpos, *errstr;
+	return parse_config_line(&ent, &ctl, &label, labels, line, NULL, 0, &errpos, &errstr) < 0;
+}
+
+static int bench_regex(char *line, strpool *labels)
+{
+	midi_ctl_desc ctl;
+	char *text = NULL;
+	int err = regex_parse_line(&ctl, line, &text) < 0;
+	free(text);
+	return err;
+}
+
+/**
+	Parses the whole config line by line
+
+	\returns time in ms
+*/
+static double run(bench_fn fn, const char *config, size_t size, int *errors)
+{
+	FILE *f = fmemopen((void*) config, size, "r");
+	strpool labels;
+	strpool_init(&labels);
+	char *line = NULL;
+	size_t line_buffer_len = 0;
+	*errors = 0;
+
+	uint64_t t = monotonic_ns();
+	while (getline(&line, &line_buffer_len, f) > 0)
+		*errors += fn(line, &labels);
+	t = monotonic_ns() - t;
+
+	free(line);
+	strpool_destroy(&labels);
+	fclose(f);
+	return t / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	regcomp(&midi_ctl_regex, midi_ctl_regex_str, REG_EXTENDED);
+	regcomp(&metadata_regex, metadata_regex_str, REG_EXTENDED);
+	regcomp(&hrule_regex, hrule_regex_str, REG_EXTENDED);
+
+	int sizes[] = {1000, 10000, 100000};
+	printf("%10s %14s %14s %10s\n", "lines", "regex [ms]", "1-pass [ms]", "speedup");
+	for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+	{
+		size_t size;
+		char *config = generate_config(sizes[i], &size);
+
+		int err_regex, err_single;
+		double t_regex = run(bench_regex, config, size, &err_regex);
+		double t_single = run(bench_single_pass, config, size, &err_single);
+		printf("%10d %14.2f %14.2f %9.1fx\n", sizes[i], t_regex, t_single, t_regex / t_single);
+
+		if (err_regex || err_single)
+			fprintf(stderr, "Unexpected parse errors (regex: %d, single-pass: %d)!\n", err_regex, err_single);
+		free(config);
+	}
+
+	regfree(&midi_ctl_regex);
+	regfree(&metadata_regex);
+	regfree(&hrule_regex);
+	return 0;
+}
@@ -1,44 +1,190 @@
 #include "alsa.h"
 #include <stdio.h>
+#include <poll.h>
 #include <alsa/asoundlib.h>
+#include "utils.h"
 
 /**
-	Sends MIDI CC with provided ALSA sequencer
+	Puts an event in the sequencer's output buffer without flushing it.
+	Source, destination and scheduling of the event are overwritten.
+	Call alsa_seq_flush() once the whole batch has been queued.
+
+	\returns 0 on success, negative ALSA error code otherwise
 */
-void alsa_seq_send_midi_cc(midictl_alsa_seq *seq, int channel, int cc, int value)
+int alsa_seq_queue_event(midictl_alsa_seq *seq, snd_seq_event_t *ev)
+{
+	snd_seq_ev_set_source(ev, seq->port);
+	snd_seq_ev_set_subs(ev);
+
+	if (seq->direct)
+		snd_seq_ev_set_direct(ev);
+	else
+		snd_seq_ev_schedule_tick(ev, seq->queue, 1, 0); // Relative to the current tick - delivered right away
+
+	int err = snd_seq_event_output(seq->seq, ev);
+	return err < 0 ? err : 0;
+}
+
+/**
+	Puts MIDI CC in the sequencer's output buffer without flushing it.
+	Call alsa_seq_flush() once the whole batch has been queued.
+
+	\returns 0 on success, negative ALSA error code otherwise
+*/
+int alsa_seq_queue_midi_cc(midictl_alsa_seq *seq, int channel, int cc, int value)
 {
 	snd_seq_event_t ev;
 	snd_seq_ev_clear(&ev);
-	snd_seq_ev_set_subs(&ev);
 	snd_seq_ev_set_controller(&ev, channel, cc, value);
-	snd_seq_ev_schedule_tick(&ev, seq->queue, 0, seq->tick_cnt++); // I hate it, but it works.
+	return alsa_seq_queue_event(seq, &ev);
+}
 
-	snd_seq_event_output(seq->seq, &ev);
-	snd_seq_drain_output(seq->seq);
-	snd_seq_sync_output_queue(seq->seq);
+/**
+	Puts a SysEx message (including F0 and F7) in the sequencer's output
+	buffer without flushing it. The data is copied, so the buffer can be
+	reused right away.
+
+	\returns 0 on success, negative ALSA error code otherwise
+*/
+int alsa_seq_queue_sysex(midictl_alsa_seq *seq, const uint8_t *data, int len)
+{
+	snd_seq_event_t ev;
+	snd_seq_ev_clear(&ev);
+	snd_seq_ev_set_sysex(&ev, len, (void*) data);
+	return alsa_seq_queue_event(seq, &ev);
+}
+
+/**
+	Drains all queued events to the sequencer in one go.
+	Does not wait for the events to be delivered.
+
+	\returns 0 on success, negative ALSA error code otherwise
+	\note In direct mode -EAGAIN means that the kernel could not take
+		everything - the rest stays in the output buffer for the next flush
+*/
+int alsa_seq_flush(midictl_alsa_seq *seq)
+{
+	int err = snd_seq_drain_output(seq->seq);
+	return err < 0 ? err : 0;
+}
+
+/**
+	Blocks until there's room in the sequencer's output (direct mode)
+*/
+void alsa_seq_wait_output(midictl_alsa_seq *seq)
+{
+	int count = snd_seq_poll_descriptors_count(seq->seq, POLLOUT);
+	struct pollfd pfds[count];
+	snd_seq_poll_descriptors(seq->seq, pfds, count, POLLOUT);
+	poll(pfds, count, -1);
+}
+
+/**
+	Fills pfds with sequencer's input descriptors
+
+	\returns number of descriptors stored
+*/
+int alsa_seq_poll_descriptors(midictl_alsa_seq *seq, struct pollfd *pfds, int space)
+{
+	int count = snd_seq_poll_descriptors_count(seq->seq, POLLIN);
+	return snd_seq_poll_descriptors(seq->seq, pfds, MIN(count, space), POLLIN);
+}
+
+/**
+	Reads next incoming event without blocking
+
+	\returns 1 if an event has been read, 0 if there are no more events,
+		negative ALSA error code on failure
+*/
+int alsa_seq_read_input(midictl_alsa_seq *seq, snd_seq_event_t **ev)
+{
+	while (1)
+	{
+		// Nothing buffered - check if the kernel has anything for us
+		if (snd_seq_event_input_pending(seq->seq, 0) <= 0)
+		{
+			int count = snd_seq_poll_descriptors_count(seq->seq, POLLIN);
+			struct pollfd pfds[count];
+			snd_seq_poll_descriptors(seq->seq, pfds, count, POLLIN);
+			if (poll(pfds, count, 0) <= 0)
+				return 0;
+		}
+
+		int err = snd_seq_event_input(seq->seq, ev);
+
+		// Input pool overflowed - some events have been lost, but we can carry on
+		if (err == -ENOSPC)
+		{
+			seq->input_overruns++;
+			continue;
+		}
+
+		if (err == -EAGAIN)
+			return 0;
+
+		return err < 0 ? err : 1;
+	}
+}
+
+/**
+	Subscribes to events from a source MIDI client
+*/
+int alsa_seq_connect_input(midictl_alsa_seq *seq, int src_client, int src_port)
+{
+	int err = snd_seq_connect_from(seq->seq, seq->port, src_client, src_port);
+	if (err < 0)
+	{
+		fprintf(stderr, "Failed connecting to the MIDI input: %s\n", snd_strerror(err));
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+	Sends single MIDI CC with provided ALSA sequencer
+*/
+void alsa_seq_send_midi_cc(midictl_alsa_seq *seq, int channel, int cc, int value)
+{
+	alsa_seq_queue_midi_cc(seq, channel, cc, value);
+	alsa_seq_flush(seq);
 }
 
 /**
 	Initializes ALSA sequencer and connects to destination MIDI client
+
+	In direct mode the sequencer handle is non-blocking and no queue is
+	allocated - events are dispatched to the destination immediately.
+	A full output buffer is then reported as -EAGAIN instead of blocking.
 */
-int alsa_seq_init(midictl_alsa_seq *seq, int dest_client, int dest_port)
+int alsa_seq_init(midictl_alsa_seq *seq, int dest_client, int dest_port, int direct)
 {
-	int err = snd_seq_open(&seq->seq, "default", SND_SEQ_OPEN_DUPLEX, 0);
+	int err = snd_seq_open(&seq->seq, "default", SND_SEQ_OPEN_DUPLEX, direct ? SND_SEQ_NONBLOCK : 0);
 	if (err < 0)
 	{
 		perror("snd_seq_open() failed");
 		return 1;
 	}
+
+	seq->direct = direct;
+	seq->queue = -1;
 	
 	// Open MIDI port
 	seq->port = snd_seq_create_simple_port(seq->seq, "midictl port",
 		SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
 		SND_SEQ_PORT_TYPE_APPLICATION);
 
+	// Make room for dense controller streams
+	snd_seq_set_input_buffer_size(seq->seq, ALSA_SEQ_INPUT_BUFFER_SIZE);
+	snd_seq_set_client_pool_input(seq->seq, ALSA_SEQ_INPUT_POOL_SIZE);
+
 	// Allocate queue and set tempo
-	seq->queue = snd_seq_alloc_named_queue(seq->seq, "midictl queue");
-	assert(seq->queue >= 0);
-	snd_seq_start_queue(seq->seq, seq->queue, NULL);
+	if (!direct)
+	{
+		seq->queue = snd_seq_alloc_named_queue(seq->seq, "midictl queue");
+		assert(seq->queue >= 0);
+		snd_seq_start_queue(seq->seq, seq->queue, NULL);
+	}
 
 	// Connect to the destination MIDI client
 	err = snd_seq_connect_to(seq->seq, seq->port, dest_client, dest_port);
@@ -48,11 +194,10 @@ int alsa_seq_init(midictl_alsa_seq *seq, int dest_client, int dest_port)
 		return 1;
 	}
 
-	seq->tick_cnt = 0;
 	return 0;
 }
 
 void alsa_seq_destroy(midictl_alsa_seq *seq)
 {
 	snd_seq_close(seq->seq);
-}
\ No newline at end of file
+}
@@ -1,17 +1,33 @@
 #ifndef MIDICTL_ALSA_H
 #define MIDICTL_ALSA_H
 
+#include <stdint.h>
 #include <alsa/asoundlib.h>
 
+/**
+	Sizes of the input buffer (bytes) and kernel's input pool (events)
+*/
+#define ALSA_SEQ_INPUT_BUFFER_SIZE 65536
+#define ALSA_SEQ_INPUT_POOL_SIZE 2000
+
 typedef struct midictl_alsa_seq
 {
 	snd_seq_t *seq;
 	int port;
-	int queue;
-	int tick_cnt;
+	int queue;   //!< Scheduling queue (-1 in direct mode)
+	int direct;  //!< Non-zero if events bypass the queue
+	unsigned int input_overruns; //!< Number of times the input pool overflowed
 } midictl_alsa_seq;
 
+extern int alsa_seq_queue_event(midictl_alsa_seq *seq, snd_seq_event_t *ev);
+extern int alsa_seq_queue_midi_cc(midictl_alsa_seq *seq, int channel, int cc, int value);
+extern int alsa_seq_queue_sysex(midictl_alsa_seq *seq, const uint8_t *data, int len);
+extern int alsa_seq_flush(midictl_alsa_seq *seq);
+extern void alsa_seq_wait_output(midictl_alsa_seq *seq);
+extern int alsa_seq_poll_descriptors(midictl_alsa_seq *seq, struct pollfd *pfds, int space);
+extern int alsa_seq_read_input(midictl_alsa_seq *seq, snd_seq_event_t **ev);
+extern int alsa_seq_connect_input(midictl_alsa_seq *seq, int src_client, int src_port);
 extern void alsa_seq_send_midi_cc(midictl_alsa_seq *seq, int channel, int cc, int value);
-extern int alsa_seq_init(midictl_alsa_seq *seq, int dest_client, int dest_port);
+extern int alsa_seq_init(midictl_alsa_seq *seq, int dest_client, int dest_port, int direct);
 extern void alsa_seq_destroy(midictl_alsa_seq *seq);
 #endif
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include "args.h"
 #include <argp.h>
 #include "midictl.h"
+#include "midi_out.h"
+#include "utils.h"
 
 const char *argp_program_version = "midictl v1.0rc1";
 const char *argp_program_bug_address = "<mrjjot@gmail.com>";
@@ -11,6 +13,12 @@ struct argp_option argp_options[] =
 	{"channel", 'c', "channel", 0, "MIDI channel"},
 	{"device",  'd', "device",  0, "Destination MIDI device"},
 	{"port",    'p', "port",    0, "Destination MIDI port"},
+	{"direct",  'D', 0,         0, "Send events directly, bypassing the sequencer queue"},
+	{"rate",    'r', "bytes/s", 0, "MIDI output rate limit (0 - unlimited, default 3125 - DIN MIDI)"},
+	{"input",   'i', "device[:port]", 0, "Source MIDI device to receive controller changes from"},
+	{"thru",    't', 0,         0, "Forward events from the input device to the destination device"},
+	{"map",     'M', "file",    0, "Remap/filter table applied to forwarded events"},
+	{"fps",     'f', "fps",     0, "Screen refresh rate limit (0 - unlimited, default 60)"},
 	{0}
 };
 
@@ -32,6 +40,30 @@ error_t args_parser(int key, char *arg, struct argp_state *state)
 			conf->midi_port_str = arg;
 			break;
 
+		case 'D':
+			conf->direct = 1;
+			break;
+
+		case 'r':
+			conf->midi_rate_str = arg;
+			break;
+
+		case 'i':
+			conf->midi_in_str = arg;
+			break;
+
+		case 't':
+			conf->midi_thru = 1;
+			break;
+
+		case 'M':
+			conf->midi_map_path = arg;
+			break;
+
+		case 'f':
+			conf->fps_str = arg;
+			break;
+
 		case ARGP_KEY_ARG:
 			if (state->arg_num >= 1) argp_usage(state);
 			conf->config_path = arg;
@@ -52,10 +84,14 @@ int args_config_interpret(midictl_args *conf)
 {
 	conf->midi_port = 0;
 	conf->midi_channel = 0;
+	conf->midi_rate = MIDI_OUT_DEFAULT_RATE;
+	conf->midi_in_device = -1;
+	conf->midi_in_port = 0;
+	conf->fps = 60;
 
 	if (conf->midi_channel_str)
 	{
-		if (!sscanf(conf->midi_channel_str, "%d", &conf->midi_channel))
+		if (!sscanf(conf->midi_channel_str, "%d", &conf->midi_channel) || !INRANGE(conf->midi_channel, 0, MIDI_CHANNELS - 1))
 		{
 			fprintf(stderr, "Invalid MIDI channel!\n");
 			return 1;
@@ -83,5 +119,38 @@ int args_config_interpret(midictl_args *conf)
 		}
 	}
 
+	if (conf->midi_in_str)
+	{
+		if (sscanf(conf->midi_in_str, "%d:%d", &conf->midi_in_device, &conf->midi_in_port) < 1)
+		{
+			fprintf(stderr, "Invalid MIDI input device!\n");
+			return 1;
+		}
+	}
+
+	if (conf->midi_thru && conf->midi_in_device < 0)
+	{
+		fprintf(stderr, "MIDI thru requires an input device!\n");
+		return 1;
+	}
+
+	if (conf->fps_str)
+	{
+		if (!sscanf(conf->fps_str, "%d", &conf->fps) || conf->fps < 0)
+		{
+			fprintf(stderr, "Invalid frame rate!\n");
+			return 1;
+		}
+	}
+
+	if (conf->midi_rate_str)
+	{
+		if (!sscanf(conf->midi_rate_str, "%d", &conf->midi_rate) || conf->midi_rate < 0)
+		{
+			fprintf(stderr, "Invalid MIDI output rate!\n");
+			return 1;
+		}
+	}
+
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,352 @@
+#include "config_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config_parser.h"
+#include "utils.h"
+
+/**
+	Cache file layout version - bump whenever anything below changes
+*/
+#define CONFIG_CACHE_VERSION 3
+static const char config_cache_magic[8] = "MIDICTLC";
+
+/**
+	Cache file header. It's followed by the sections listed
+	in the order of the fields, each aligned to 8 bytes.
+*/
+typedef struct config_cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_count;
+	config_cache_key key;
+	uint32_t ctl_count;
+	uint32_t reserved;
+	uint64_t strings_size;
+} config_cache_header;
+
+/**
+	Menu entry as stored in the cache
+*/
+typedef struct config_cache_entry
+{
+	int32_t type;
+	int32_t line;
+	int32_t ctl;
+	int32_t label;  //!< Offset in the string block or -1
+	int32_t folded; //!< Offset of the case-folded label or -1
+} config_cache_entry;
+
+#define ALIGN8(x) (((x) + 7) & ~(size_t) 7)
+
+/**
+	Controller store arrays, in the order they're stored in
+*/
+#define CONFIG_CACHE_CTL_ARRAYS(X) \
+	X(cc) X(channel) X(value) X(min) X(max) X(def) X(flags) X(entry)
+
+#define CTL_ARRAY_SIZE(name, count) ALIGN8((size_t)(count) * sizeof(((midi_ctl_store*) 0)->name[0]))
+
+/**
+	\returns path of the cache file for a config (malloc'ed)
+*/
+static char *config_cache_path(const char *config_path)
+{
+	char *path = NULL;
+	if (asprintf(&path, "%s.cache", config_path) < 0)
+		return NULL;
+	return path;
+}
+
+/**
+	Computes the cache key of an open config file.
+	The file position is not changed.
+
+	\returns 0 on success
+*/
+int config_cache_key_compute(FILE *f, config_cache_key *key)
+{
+	int fd = fileno(f);
+	struct stat st;
+	if (fstat(fd, &st))
+		return 1;
+
+	key->mtime_sec = st.st_mtim.tv_sec;
+	key->mtime_nsec = st.st_mtim.tv_nsec;
+	key->size = st.st_size;
+	key->hash = 14695981039346656037ull;
+
+	if (st.st_size == 0)
+		return 0;
+
+	unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return 1;
+
+	for (off_t i = 0; i < st.st_size; i++)
+	{
+		key->hash ^= data[i];
+		key->hash *= 1099511628211ull;
+	}
+
+	munmap(data, st.st_size);
+	return 0;
+}
+
+/**
+	Loads the menu from the config's cache, if it's up to date.
+	The controller state is copied, while the labels are used
+	directly from the mapped file. Duplicates are checked again, as they
+	depend on the default MIDI channel.
+
+	\returns 0 on success, non-zero if the cache is missing, stale, damaged
+		or the controllers conflict on this channel
+*/
+int config_cache_load(const char *config_path, const config_cache_key *key, int default_channel, menu_list *menu)
+{
+	char *path = config_cache_path(config_path);
+	if (!path)
+		return 1;
+
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return 1;
+
+	struct stat st;
+	if (fstat(fd, &st) || (size_t) st.st_size < sizeof(config_cache_header))
+	{
+		close(fd);
+		return 1;
+	}
+
+	size_t size = st.st_size;
+	char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return 1;
+
+	// Validate the header
+	const config_cache_header *hdr = (const config_cache_header*) data;
+	if (memcmp(hdr->magic, config_cache_magic, sizeof(config_cache_magic))
+		|| hdr->version != CONFIG_CACHE_VERSION
+		|| memcmp(&hdr->key, key, sizeof(*key))
+		|| hdr->ctl_count == 0)
+	{
+		munmap(data, size);
+		return 1;
+	}
+
+	// Locate the sections and check they all fit in the file
+	int entry_count = hdr->entry_count;
+	int ctl_count = hdr->ctl_count;
+	size_t offset = ALIGN8(sizeof(*hdr));
+	const config_cache_entry *entries = (const config_cache_entry*)(data + offset);
+	offset += ALIGN8((size_t) entry_count * sizeof(config_cache_entry));
+
+	const char *ctl_data = data + offset;
+#define X(name) offset += CTL_ARRAY_SIZE(name, ctl_count);
+	CONFIG_CACHE_CTL_ARRAYS(X)
+#undef X
+	const uint64_t *changed = (const uint64_t*)(data + offset);
+	offset += BITSET_WORDS(ctl_count) * sizeof(uint64_t);
+
+	const char *strings = data + offset;
+	if (offset > size || hdr->strings_size != size - offset || (hdr->strings_size && strings[hdr->strings_size - 1]))
+	{
+		munmap(data, size);
+		return 1;
+	}
+
+	// Controllers
+	if (menu_list_init(menu, config_path, default_channel))
+	{
+		munmap(data, size);
+		return 1;
+	}
+
+	midi_ctl_store *ctls = &menu->ctls;
+	int err = midi_ctl_store_resize(ctls, ctl_count);
+	if (!err)
+	{
+		const char *p = ctl_data;
+#define X(name) \
+		memcpy(ctls->name, p, ctl_count * sizeof(ctls->name[0])); \
+		p += CTL_ARRAY_SIZE(name, ctl_count);
+		CONFIG_CACHE_CTL_ARRAYS(X)
+#undef X
+		memcpy(ctls->changed, changed, BITSET_WORDS(ctl_count) * sizeof(uint64_t));
+		memset(ctls->page, 0, ctl_count * sizeof(ctls->page[0]));
+		for (int i = 0; i < ctl_count; i++)
+			ctls->sysex_addr[i] = -1;
+	}
+
+	// Menu entries
+	menu->entries = malloc(MAX(entry_count, 1) * sizeof(menu_entry));
+	menu->capacity = entry_count;
+	err |= menu->entries == NULL;
+	for (int i = 0; !err && i < entry_count; i++)
+	{
+		const config_cache_entry *ce = &entries[i];
+		if ((ce->type != ENTRY_MIDI_CTL && ce->type != ENTRY_HRULE)
+			|| (ce->type == ENTRY_MIDI_CTL && !INRANGE(ce->ctl, 0, ctl_count - 1))
+			|| ce->label >= (int64_t) hdr->strings_size
+			|| ce->folded >= (int64_t) hdr->strings_size)
+		{
+			err = 1;
+			break;
+		}
+
+		menu_entry *ent = &menu->entries[menu->size++];
+		memset(ent, 0, sizeof(*ent));
+		ent->type = ce->type;
+		ent->line = ce->line;
+		ent->ctl = ce->ctl;
+		ent->text = ce->label >= 0 ? (char*) strings + ce->label : NULL;
+		ent->folded = ce->folded >= 0 ? strings + ce->folded : NULL;
+	}
+
+	for (int i = 0; !err && i < ctl_count; i++)
+		err = !INRANGE(ctls->entry[i], 0, entry_count - 1) || !INRANGE(ctls->cc[i], 0, midi_ctl_max_cc(ctls, i))
+			|| !INRANGE(ctls->channel[i], -1, MIDI_CHANNELS - 1) || (ctls->flags[i] & MIDI_CTL_SYSEX);
+
+	// Let the parser report the duplicate
+	if (!err)
+		err = midi_ctl_index_build(&menu->index, ctls, default_channel) != -1;
+
+	if (err)
+	{
+		menu_list_destroy(menu);
+		munmap(data, size);
+		return 1;
+	}
+
+	menu->pages[0].ctl_count = ctl_count;
+	if (menu_page_index_sections(menu))
+	{
+		menu_list_destroy(menu);
+		munmap(data, size);
+		return 1;
+	}
+
+	menu->map = data;
+	menu->map_size = size;
+	return 0;
+}
+
+/**
+	Writes padding so the next section is aligned to 8 bytes
+*/
+static void config_cache_pad(FILE *f, size_t written)
+{
+	static const char zeros[8] = {0};
+	fwrite(zeros, 1, ALIGN8(written) - written, f);
+}
+
+/**
+	Writes the menu to the config's cache. The file is replaced atomically.
+
+	\returns 0 on success
+*/
+int config_cache_store(const char *config_path, const config_cache_key *key, const menu_list *menu)
+{
+	char *path = config_cache_path(config_path);
+	char *tmp_path = NULL;
+	if (!path || asprintf(&tmp_path, "%s.tmp", path) < 0)
+	{
+		free(path);
+		return 1;
+	}
+
+	FILE *f = fopen(tmp_path, "wb");
+	if (!f)
+	{
+		free(tmp_path);
+		free(path);
+		return 1;
+	}
+
+	const midi_ctl_store *ctls = &menu->ctls;
+	const char *strings = menu->labels.data;
+
+	config_cache_header hdr = {
+		.version = CONFIG_CACHE_VERSION,
+		.entry_count = menu->size,
+		.key = *key,
+		.ctl_count = ctls->count,
+		.strings_size = menu->labels.size,
+	};
+	memcpy(hdr.magic, config_cache_magic, sizeof(hdr.magic));
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	config_cache_pad(f, sizeof(hdr));
+
+	for (int i = 0; i < menu->size; i++)
+	{
+		const menu_entry *ent = &menu->entries[i];
+		config_cache_entry ce = {
+			.type = ent->type,
+			.line = ent->line,
+			.ctl = ent->ctl,
+			.label = ent->text ? ent->text - strings : -1,
+			.folded = ent->folded ? ent->folded - strings : -1,
+		};
+		fwrite(&ce, sizeof(ce), 1, f);
+	}
+	config_cache_pad(f, menu->size * sizeof(config_cache_entry));
+
+#define X(name) \
+	fwrite(ctls->name, sizeof(ctls->name[0]), ctls->count, f); \
+	config_cache_pad(f, ctls->count * sizeof(ctls->name[0]));
+	CONFIG_CACHE_CTL_ARRAYS(X)
+#undef X
+	fwrite(ctls->changed, sizeof(uint64_t), BITSET_WORDS(ctls->count), f);
+
+	fwrite(strings, 1, menu->labels.size, f);
+
+	int err = ferror(f);
+	err |= fclose(f) != 0;
+	if (!err)
+		err = rename(tmp_path, path) != 0;
+	else
+		unlink(tmp_path);
+
+	free(tmp_path);
+	free(path);
+	return err;
+}
+
+/**
+	Loads the config, using its cache if it's up to date.
+	Otherwise the config is parsed and the cache is rebuilt.
+
+	\param default_channel MIDI channel of controllers without 'chan' key
+	\param errf Stream error messages are written to
+	\returns 0 on success
+*/
+int config_load(const char *config_path, int default_channel, menu_list *menu, FILE *errf)
+{
+	FILE *f = fopen(config_path, "rt");
+	if (f == NULL)
+	{
+		fprintf(errf, "Could not open config file: %s\n", strerror(errno));
+		return 1;
+	}
+
+	config_cache_key key;
+	int cache_ok = !config_cache_key_compute(f, &key);
+	int err = 0;
+	if (!cache_ok || config_cache_load(config_path, &key, default_channel, menu))
+	{
+		err = build_menu_from_config_file(f, config_path, default_channel, menu, errf);
+		if (!err && cache_ok && menu_list_cacheable(menu))
+			config_cache_store(config_path, &key, menu);
+	}
+
+	fclose(f);
+	return err;
+}
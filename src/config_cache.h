@@ -0,0 +1,24 @@
+#ifndef MIDICTL_CONFIG_CACHE_H
+#define MIDICTL_CONFIG_CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "midictl.h"
+
+/**
+	Identifies the exact version of the config file a cache has been built from
+*/
+typedef struct config_cache_key
+{
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t size;
+	uint64_t hash; //!< FNV-1a hash of the contents
+} config_cache_key;
+
+extern int config_cache_key_compute(FILE *f, config_cache_key *key);
+extern int config_cache_load(const char *config_path, const config_cache_key *key, int default_channel, menu_list *menu);
+extern int config_cache_store(const char *config_path, const config_cache_key *key, const menu_list *menu);
+extern int config_load(const char *config_path, int default_channel, menu_list *menu, FILE *errf);
+
+#endif
@@ -1,328 +1,1400 @@
 #include "midictl.h"
 #include <stdio.h>
 #include <stdlib.h>
-#include <regex.h>
 #include <string.h>
-#include <assert.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "utils.h"
 
 /**
-	Regex for matching controller lines in the config
+	Metadata keys
 */
-static const char *midi_ctl_regex_str = "^\\s*([0-9]*)?\\s*(\\[(.*)\\])?\\s*(.*)$";
-static regex_t midi_ctl_regex;
+typedef enum config_key
+{
+	KEY_CC,
+	KEY_MIN,
+	KEY_MAX,
+	KEY_DEF,
+	KEY_CHAN,
+	KEY_SLIDER,
+	KEY_UPDATE,
+	KEY_HIRES,
+	KEY_NRPN,
+	KEY_RPN,
+	KEY_SYSEX,
+	KEY_ADDR,
+	KEY_COUNT
+} config_key;
+
+static const char *config_key_names[KEY_COUNT] = {
+	[KEY_CC] = "cc",
+	[KEY_MIN] = "min",
+	[KEY_MAX] = "max",
+	[KEY_DEF] = "def",
+	[KEY_CHAN] = "chan",
+	[KEY_SLIDER] = "slider",
+	[KEY_UPDATE] = "update",
+	[KEY_HIRES] = "hires",
+	[KEY_NRPN] = "nrpn",
+	[KEY_RPN] = "rpn",
+	[KEY_SYSEX] = "sysex",
+	[KEY_ADDR] = "addr",
+};
 
 /**
-	Regex for parsing metadata
+	\returns whether the character ends the meaningful part of a line
 */
-static const char *metadata_regex_str = "\\s*([a-zA-z]+)\\s*=\\s*(-?[0-9]+)\\s*,?";
-static regex_t metadata_regex;
+static inline int is_line_end(char c)
+{
+	return c == 0 || c == '#';
+}
 
 /**
-	Regex for matching hrules
+	Skips whitespace (but not the end of the line)
 */
-static const char *hrule_regex_str = "^\\s*---+\\s*(.*)";
-static regex_t hrule_regex;
-
+static inline const char *skip_space(const char *p)
+{
+	while (*p && isspace((unsigned char) *p))
+		p++;
+	return p;
+}
 
 /**
-	Parses metadata string and properly configures
-	MIDI_CTL menu entry
+	Reads an optionally negative decimal number or a hex number
+	with '0x' prefix. Values too big to be meaningful are saturated.
+
+	\returns pointer past the number or NULL if there are no digits
 */
-static int parse_metadata(menu_entry *ent, const char *metadata)
+static const char *read_int(const char *p, int *value)
 {
-	int max_matches = 3;
-	regmatch_t matches[max_matches];
-	int offset = 0;
-	int fail = 0;
-	int cnt = 0;
+	int neg = *p == '-';
+	if (neg)
+		p++;
 
-	while (!fail)
+	// Hex numbers are mostly SysEx addresses, so they can be much bigger
+	if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X') && isxdigit((unsigned char) p[2]))
 	{
-		const char *str = metadata + offset;
-		int err = regexec(&metadata_regex, str, max_matches, matches, 0);
-		if (err) break;
+		long v = 0;
+		for (p += 2; isxdigit((unsigned char) *p); p++)
+			v = MIN(v * 16 + (isdigit((unsigned char) *p) ? *p - '0' : tolower((unsigned char) *p) - 'a' + 10), INT32_MAX);
 
-		// If key or value is missing, abort
-		if (matches[1].rm_so < 0 || matches[2].rm_so < 0)
-		{
-			fail = 1;
-			break;
-		}
+		*value = neg ? -v : v;
+		return p;
+	}
 
-		// Extract key and value
-		char *key = strndup(str + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
-		int value = atoi(str + matches[2].rm_so);
-		
-		// TODO: handle negative values
-		if (!strcmp(key, "cc"))
-			ent->midi_ctl.cc = value;
-		else if (!strcmp(key, "min"))
-			ent->midi_ctl.min = value;
-		else if (!strcmp(key, "max"))
-			ent->midi_ctl.max = value;
-		else if (!strcmp(key, "def"))
-			ent->midi_ctl.def = value;
-		else if (!strcmp(key, "chan"))
-			ent->midi_ctl.channel = value;
-		else if (!strcmp(key, "slider"))
-			ent->midi_ctl.slider = value != 0;
-		else if (!strcmp(key, "update"))
-			ent->midi_ctl.changed = value != 0;
-		else
-			fail = 1;
+	if (!isdigit((unsigned char) *p))
+		return NULL;
 
-		free(key);
-		offset += matches[0].rm_eo;
-		cnt++;
-	}
+	int v = 0;
+	for (; isdigit((unsigned char) *p); p++)
+		v = MIN(v * 10 + (*p - '0'), 1000000);
 
-	if (cnt == 0) fail = 1;
-	return fail;
+	*value = neg ? -v : v;
+	return p;
 }
 
 /**
-	Builds menu entry from a config file line
-	\returns -1 on error, 1 if the menu entry was set up and 0 if the line has been ignored (and the entry has not been set up)
+	Parses metadata (key = value pairs after the opening bracket)
+	and properly configures the controller. Positions of the keys
+	are stored in keypos for error reporting.
+
+	\param templates SysEx templates defined so far
+	\returns pointer past the closing bracket or NULL on error
 */
-static int parse_config_line(menu_entry *ent, char *line, const char **errstr)
+static const char *parse_metadata(midi_ctl_desc *ctl, const char *p, const sysex_template *templates, int template_count, const char **keypos, const char **errpos, const char **errstr)
 {
-	// Regex maches array
-	int max_matches = 16;
-	regmatch_t matches[max_matches];
-
-	// Ignore empty lines
-	if (isempty(line)) return 0;
+	int cnt = 0;
 
-	// Lines starting with --- are horizontal rules/headers
-	if (!regexec(&hrule_regex, line, max_matches, matches, 0))
+	while (1)
 	{
-		ent->type = ENTRY_HRULE;
-		if (matches[1].rm_so >= 0)
-			ent->text = strndup(line + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
-		else
-			ent->text = NULL;
+		p = skip_space(p);
+		if (*p == ']' && cnt)
+			return p + 1;
 
-		return 1;
-	}
+		// Key
+		const char *key = p;
+		while (isalpha((unsigned char) *p))
+			p++;
+		int key_len = p - key;
 
-	// Try to match to controller line format
-	if (!regexec(&midi_ctl_regex, line, max_matches, matches, 0))
-	{
-		ent->type = ENTRY_MIDI_CTL;
-		ent->text = NULL;
-		ent->midi_ctl.cc = -1;
-		ent->midi_ctl.min = 0;
-		ent->midi_ctl.max = 127;
-		ent->midi_ctl.channel = -1;
-		ent->midi_ctl.def = -1;
-		ent->midi_ctl.slider = 1;
-		ent->midi_ctl.changed = 0;
-
-		// Match CC ID
-		if (matches[1].rm_so >= 0)
-			sscanf(line + matches[1].rm_so, "%d", &ent->midi_ctl.cc);
-
-		// Match metadata
-		if (matches[3].rm_so >= 0)
+		if (!key_len)
 		{
-			char *metadata = strndup(line + matches[3].rm_so, matches[3].rm_eo - matches[3].rm_so);
-			int err = parse_metadata(ent, metadata);
-			free(metadata);
-
-			// Metadata parsing failed
-			if (err)
-			{
-				*errstr = "Invalid metadata syntax or key!";
-				return -1;
-			}
+			*errpos = p;
+			*errstr = is_line_end(*p) ? "Missing ']'!" : "Expected metadata key!";
+			return NULL;
 		}
 
-		// Check ranges
-		if (ent->midi_ctl.min >= ent->midi_ctl.max)
-		{
-			*errstr = "'min' must be less than max!";
-			return -1;
-		}
+		int k;
+		for (k = 0; k < KEY_COUNT; k++)
+			if (!strncmp(key, config_key_names[k], key_len) && config_key_names[k][key_len] == 0)
+				break;
 
-		if (!INRANGE(ent->midi_ctl.min, 0, 127))
+		if (k == KEY_COUNT)
 		{
-			*errstr = "Invalid value for 'min'!";
-			return -1;
+			*errpos = key;
+			*errstr = "Unknown metadata key!";
+			return NULL;
 		}
 
-		if (!INRANGE(ent->midi_ctl.max, 0, 127))
+		// =
+		p = skip_space(p);
+		if (*p != '=')
 		{
-			*errstr = "Invalid value for 'max'!";
-			return -1;
+			*errpos = p;
+			*errstr = "Expected '='!";
+			return NULL;
 		}
+		p = skip_space(p + 1);
 
-		if (ent->midi_ctl.def > 0 && !INRANGE(ent->midi_ctl.def, ent->midi_ctl.min, ent->midi_ctl.max))
+		// Value - SysEx templates are referred to by name
+		int value;
+		const char *end = NULL;
+		if (k == KEY_SYSEX)
 		{
-			*errstr = "Default value cannot be outside defined range!";
-			return -1;
-		}
+			for (end = p; isalnum((unsigned char) *end) || *end == '_' || *end == '-'; end++);
+			for (value = 0; value < template_count; value++)
+				if (!strncmp(templates[value].name, p, end - p) && templates[value].name[end - p] == 0)
+					break;
 
-		if (ent->midi_ctl.channel > 0 && !INRANGE(ent->midi_ctl.channel, 0, 15))
+			if (end == p || value == template_count)
+			{
+				*errpos = p;
+				*errstr = "Unknown SysEx template!";
+				return NULL;
+			}
+		}
+		else if (!(end = read_int(p, &value)))
 		{
-			*errstr = "Invalid MIDI channel!";
-			return -1;
+			*errpos = p;
+			*errstr = "Expected a number!";
+			return NULL;
 		}
+		p = skip_space(end);
 
-		// Default
-		// TODO replace with midi_ctl_reset
-		if (ent->midi_ctl.def < 0)
-			ent->midi_ctl.value = (ent->midi_ctl.min + ent->midi_ctl.max) / 2;
-		else
+		keypos[k] = key;
+		switch (k)
 		{
-			ent->midi_ctl.value = ent->midi_ctl.def;
+			case KEY_CC:     ctl->cc = value; break;
+			case KEY_MIN:    ctl->min = value; break;
+			case KEY_MAX:    ctl->max = value; break;
+			case KEY_DEF:    ctl->def = value; break;
+			case KEY_CHAN:   ctl->channel = value; break;
+			case KEY_SLIDER: ctl->slider = value != 0; break;
+			case KEY_UPDATE: ctl->update = value != 0; break;
+			case KEY_HIRES:  ctl->hires = value != 0; break;
+			case KEY_NRPN:   ctl->cc = value; ctl->param = MIDI_CTL_NRPN; break;
+			case KEY_RPN:    ctl->cc = value; ctl->param = MIDI_CTL_RPN; break;
+			case KEY_SYSEX:  ctl->cc = value; ctl->param = MIDI_CTL_SYSEX; break;
+			case KEY_ADDR:   ctl->sysex_addr = value; break;
 		}
+		cnt++;
 
-		// CC is not set
-		if (ent->midi_ctl.cc == -1)
+		// Separator
+		if (*p == ',')
+			p++;
+		else if (*p != ']')
 		{
-			*errstr = "MIDI CC value missing!";
-			return -1;
+			*errpos = p;
+			*errstr = is_line_end(*p) ? "Missing ']'!" : "Expected ',' or ']'!";
+			return NULL;
 		}
+	}
+}
 
-		// Check CC range
-		if (ent->midi_ctl.cc < 0 || ent->midi_ctl.cc > 127)
-		{
-			*errstr = "MIDI CC value invalid (bad range)!";
+/**
+	Builds menu entry from a config file line in a single pass. The label is put
+	in the string pool and its offset is returned via label (-1 if the entry has no label).
+	For controller entries, the controller definition is returned via ctl.
+
+	Line format is: [cc] ['[' key = value, ... ']'] name ['#' comment]
+	or: ---[-...] [title] ['#' comment]
+
+	\param templates SysEx templates the controller can refer to
+	\returns -1 on error (with errpos pointing at the problem), 1 if the menu entry was set up
+		and 0 if the line has been ignored (and the entry has not been set up)
+*/
+static int parse_config_line(menu_entry *ent, midi_ctl_desc *ctl, long *label, strpool *labels, const char *line, const sysex_template *templates, int template_count, const char **errpos, const char **errstr)
+{
+	const char *p = skip_space(line);
+
+	// Ignore empty lines
+	if (is_line_end(*p)) return 0;
+
+	// Lines starting with --- are horizontal rules/headers
+	if (!strncmp(p, "---", 3))
+	{
+		p = skip_space(p + strspn(p, "-"));
+		const char *end = p + strcspn(p, "#");
+		while (end > p && isspace((unsigned char) end[-1]))
+			end--;
+
+		ent->type = ENTRY_HRULE;
+		ent->text = NULL;
+		*label = strpool_intern(labels, p, end - p);
+		return 1;
+	}
+
+	ent->type = ENTRY_MIDI_CTL;
+	ent->text = NULL;
+	ctl->cc = -1;
+	ctl->min = 0;
+	ctl->max = 127;
+	ctl->channel = -1;
+	ctl->def = -1;
+	ctl->slider = 1;
+	ctl->update = 0;
+	ctl->hires = 0;
+	ctl->param = 0;
+	ctl->sysex_addr = -1;
+
+	// Where the values come from - for error reporting
+	const char *start = p;
+	const char *keypos[KEY_COUNT];
+	for (int k = 0; k < KEY_COUNT; k++)
+		keypos[k] = start;
+
+	// CC ID
+	if (isdigit((unsigned char) *p))
+	{
+		p = skip_space(read_int(p, &ctl->cc));
+	}
+
+	// Metadata
+	if (*p == '[')
+	{
+		p = parse_metadata(ctl, p + 1, templates, template_count, keypos, errpos, errstr);
+		if (!p)
 			return -1;
-		}
+		p = skip_space(p);
+	}
 
-		// Get name
-		if (matches[4].rm_so >= 0)
-		{
-			ent->text = strndup(line + matches[4].rm_so, matches[4].rm_eo - matches[4].rm_so);
-		}
+	// Name - the rest of the line
+	const char *name = p;
+	const char *end = p + strcspn(p, "#");
+	while (end > name && isspace((unsigned char) end[-1]))
+		end--;
+
+	// 14-bit and SysEx controllers span the whole range unless told otherwise
+	const sysex_template *t = ctl->param == MIDI_CTL_SYSEX ? &templates[ctl->cc] : NULL;
+	int value_max = t ? sysex_template_max(t) : ctl->hires ? MIDI_CTL_HIRES_MAX : 127;
+	if ((ctl->hires || t) && keypos[KEY_MAX] == start)
+		ctl->max = value_max;
+
+	// Check ranges
+	*errstr = NULL;
+	if (ctl->min >= ctl->max)
+	{
+		*errpos = keypos[KEY_MIN];
+		*errstr = "'min' must be less than max!";
+	}
+	else if (!INRANGE(ctl->min, 0, value_max))
+	{
+		*errpos = keypos[KEY_MIN];
+		*errstr = "Invalid value for 'min'!";
+	}
+	else if (!INRANGE(ctl->max, 0, value_max))
+	{
+		*errpos = keypos[KEY_MAX];
+		*errstr = "Invalid value for 'max'!";
+	}
+	else if (ctl->def >= 0 && !INRANGE(ctl->def, ctl->min, ctl->max))
+	{
+		*errpos = keypos[KEY_DEF];
+		*errstr = "Default value cannot be outside defined range!";
+	}
+	else if (ctl->channel >= 0 && !INRANGE(ctl->channel, 0, 15))
+	{
+		*errpos = keypos[KEY_CHAN];
+		*errstr = "Invalid MIDI channel!";
+	}
+	else if (ctl->param && (keypos[KEY_CC] != start || isdigit((unsigned char) *start)
+		|| (keypos[KEY_NRPN] != start) + (keypos[KEY_RPN] != start) + (keypos[KEY_SYSEX] != start) > 1))
+	{
+		*errpos = keypos[ctl->param == MIDI_CTL_NRPN ? KEY_NRPN : ctl->param == MIDI_CTL_RPN ? KEY_RPN : KEY_SYSEX];
+		*errstr = "Only one of CC number, 'nrpn', 'rpn' and 'sysex' can be used!";
+	}
+	else if (t && t->addr_pos >= 0 && !sysex_addr_valid(t, ctl->sysex_addr))
+	{
+		*errpos = keypos[KEY_ADDR] != start ? keypos[KEY_ADDR] : keypos[KEY_SYSEX];
+		*errstr = keypos[KEY_ADDR] != start ? "Address does not fit the SysEx template!" : "SysEx controllers need 'addr'!";
+	}
+	else if (t && ctl->hires)
+	{
+		*errpos = keypos[KEY_HIRES];
+		*errstr = "SysEx value size is set by the template!";
+	}
+	else if (ctl->cc == -1)
+	{
+		*errpos = name;
+		*errstr = "MIDI CC value missing!";
+	}
+	else if (ctl->param && !t && !INRANGE(ctl->cc, 0, MIDI_PARAMS - 1))
+	{
+		*errpos = keypos[ctl->param == MIDI_CTL_NRPN ? KEY_NRPN : KEY_RPN];
+		*errstr = "Parameter number invalid (bad range)!";
+	}
+	else if (!ctl->param && (ctl->cc < 0 || ctl->cc > 127))
+	{
+		*errpos = keypos[KEY_CC];
+		*errstr = "MIDI CC value invalid (bad range)!";
+	}
+	else if (ctl->hires && !ctl->param && ctl->cc >= MIDI_CTL_LSB_OFFSET)
+	{
+		*errpos = keypos[KEY_CC];
+		*errstr = "14-bit controllers must use CC 0-31!";
+	}
+
+	if (*errstr)
+		return -1;
+
+	*label = strpool_intern(labels, name, end - name);
+	return 1;
+}
+
+/**
+	Maximum include nesting depth
+*/
+#define CONFIG_MAX_INCLUDE_DEPTH 8
+
+/**
+	Frees the menu, all its pages and labels
+*/
+void menu_list_destroy(menu_list *menu)
+{
+	for (int i = 0; i < menu->page_count; i++)
+	{
+		free(menu->pages[i].name);
+		free(menu->pages[i].entries);
+		free(menu->pages[i].sections);
+		free(menu->pages[i].collapsed);
+		strpool_destroy(&menu->pages[i].labels);
+	}
+	free(menu->pages);
+
+	for (int i = 0; i < menu->file_count; i++)
+		free(menu->files[i]);
+	free(menu->files);
+
+	for (int i = 0; i < menu->sysex_count; i++)
+		free(menu->sysex[i].name);
+	free(menu->sysex);
+	free(menu->path);
+
+	free(menu->entries);
+	strpool_destroy(&menu->labels);
+	midi_ctl_store_destroy(&menu->ctls);
+	midi_ctl_index_destroy(&menu->index);
+	midi_ctl_map_destroy(&menu->deferred_params);
+	midi_ctl_map_destroy(&menu->deferred_sysex);
+	for (int i = 0; i < menu->deferred_name_count; i++)
+		free(menu->deferred_names[i]);
+	free(menu->deferred_names);
+	if (menu->map)
+		munmap(menu->map, menu->map_size);
+	memset(menu, 0, sizeof(*menu));
+}
+
+/**
+	Sets up an empty menu with the implicit first page
+
+	\param default_channel MIDI channel of controllers without 'chan' key
+*/
+int menu_list_init(menu_list *menu, const char *path, int default_channel)
+{
+	memset(menu, 0, sizeof(*menu));
+	strpool_init(&menu->labels);
+	menu->default_channel = default_channel;
+
+	menu->path = strdup(path);
+	menu->pages = calloc(1, sizeof(menu_page));
+	if (!menu->path || !menu->pages)
+	{
+		menu_list_destroy(menu);
+		return 1;
+	}
+
+	midi_ctl_index_init(&menu->index);
+	memset(menu->deferred, 0xff, sizeof(menu->deferred));
+
+	menu->page_count = 1;
+	menu->pages[0].loaded = 1;
+	menu->pages[0].cursor = -1;
+	menu->pages[0].first_line = 1;
+	return 0;
+}
+
+/**
+	\returns index of the page with given name or -1 if there's none.
+		The first page can be unnamed.
+*/
+int menu_find_page(const menu_list *menu, const char *name)
+{
+	for (int i = 0; i < menu->page_count; i++)
+	{
+		const char *n = menu->pages[i].name;
+		if (n == name || (n && name && !strcmp(n, name)))
+			return i;
+	}
+	return -1;
+}
+
+/**
+	\returns index of the SysEx template with given name or -1 if there's none
+*/
+int menu_find_sysex(const menu_list *menu, const char *name, int name_len)
+{
+	for (int i = 0; i < menu->sysex_count; i++)
+		if (!strncmp(menu->sysex[i].name, name, name_len) && menu->sysex[i].name[name_len] == 0)
+			return i;
+	return -1;
+}
+
+/**
+	Keeps a value loaded from a dump for a controller which hasn't been loaded yet
+
+	\returns 0 on success
+*/
+int menu_defer_value(menu_list *menu, int channel, int addr, int value)
+{
+	value = CLAMP(value, 0, INT16_MAX);
+	if (addr < MIDI_CCS)
+	{
+		menu->deferred[channel][addr] = value;
+		return 0;
+	}
+	return midi_ctl_map_put(&menu->deferred_params, midi_ctl_key(channel, addr), value);
+}
+
+/**
+	\returns index of the template name in deferred_names or -1 if there's none
+*/
+static int menu_find_deferred_name(const menu_list *menu, const char *name, int name_len)
+{
+	for (int i = 0; i < menu->deferred_name_count; i++)
+		if (!strncmp(menu->deferred_names[i], name, name_len) && menu->deferred_names[i][name_len] == 0)
+			return i;
+	return -1;
+}
+
+/**
+	Keeps a value loaded from a dump for a SysEx controller which hasn't
+	been loaded yet. Its template may not be loaded either, so the value
+	is kept by template name.
+
+	\returns 0 on success
+*/
+int menu_defer_sysex(menu_list *menu, const char *name, int name_len, int addr, int value)
+{
+	int t = menu_find_deferred_name(menu, name, name_len);
+	if (t < 0)
+	{
+		char **names = realloc(menu->deferred_names, (menu->deferred_name_count + 1) * sizeof(char*));
+		if (!names)
+			return 1;
+		menu->deferred_names = names;
+
+		names[menu->deferred_name_count] = strndup(name, name_len);
+		if (!names[menu->deferred_name_count])
+			return 1;
+		t = menu->deferred_name_count++;
+	}
+
+	return midi_ctl_map_put(&menu->deferred_sysex, midi_ctl_sysex_key(t, addr), CLAMP(value, 0, INT16_MAX));
+}
+
+/**
+	Removes a value from a map of deferred values
+
+	\returns the value or -1 if there was none
+*/
+static int menu_take_deferred_key(midi_ctl_map *map, uint64_t key)
+{
+	int *p = midi_ctl_map_find(map, key);
+	if (!p)
+		return -1;
+
+	int v = *p;
+	midi_ctl_map_remove(map, key);
+	return v;
+}
+
+/**
+	Takes the deferred value for given channel and address
+
+	\returns the value or -1 if there was none
+*/
+int menu_take_deferred(menu_list *menu, int channel, int addr)
+{
+	if (addr < MIDI_CCS)
+	{
+		int v = menu->deferred[channel][addr];
+		menu->deferred[channel][addr] = -1;
+		return v;
+	}
+
+	return menu_take_deferred_key(&menu->deferred_params, midi_ctl_key(channel, addr));
+}
+
+/**
+	Takes the deferred value for a SysEx controller
+
+	\returns the value or -1 if there was none
+*/
+int menu_take_deferred_sysex(menu_list *menu, const char *name, int addr)
+{
+	if (!menu->deferred_sysex.count)
+		return -1;
+
+	int t = menu_find_deferred_name(menu, name, strlen(name));
+	if (t < 0)
+		return -1;
+
+	return menu_take_deferred_key(&menu->deferred_sysex, midi_ctl_sysex_key(t, addr));
+}
+
+/**
+	Copies deferred values of one menu to another (e.g. on reload)
+
+	\returns 0 on success
+*/
+int menu_copy_deferred(menu_list *dst, const menu_list *src)
+{
+	memcpy(dst->deferred, src->deferred, sizeof(dst->deferred));
+	if (midi_ctl_map_copy(&dst->deferred_params, &src->deferred_params)
+		|| midi_ctl_map_copy(&dst->deferred_sysex, &src->deferred_sysex))
+		return 1;
+
+	dst->deferred_names = calloc(src->deferred_name_count, sizeof(char*));
+	if (src->deferred_name_count && !dst->deferred_names)
+		return 1;
+
+	for (int i = 0; i < src->deferred_name_count; i++)
+	{
+		dst->deferred_names[i] = strdup(src->deferred_names[i]);
+		if (!dst->deferred_names[i])
+			return 1;
+		dst->deferred_name_count++;
+	}
+
+	return 0;
+}
+
+/**
+	\returns whether the menu can be stored in the config cache - only
+		flat configs without pages, includes and SysEx templates can
+*/
+int menu_list_cacheable(const menu_list *menu)
+{
+	return menu->page_count == 1 && menu->file_count == 0 && menu->sysex_count == 0;
+}
+
+/**
+	\returns menu entry displaying a controller
+*/
+const menu_entry *menu_ctl_entry(const menu_list *menu, int id)
+{
+	int page = menu->ctls.page[id];
+	const menu_entry *entries = page == menu->page ? menu->entries : menu->pages[page].entries;
+	return &entries[menu->ctls.entry[id]];
+}
+
+/**
+	Finds sections of the current page, all expanded
+
+	\returns 0 on success
+*/
+int menu_page_index_sections(menu_list *menu)
+{
+	menu_page *page = &menu->pages[menu->page];
+	int count = 0;
+	for (int i = 0; i < menu->size; i++)
+		count += menu->entries[i].type == ENTRY_HRULE;
+
+	page->sections = malloc(MAX(count, 1) * sizeof(menu_section));
+	page->collapsed = calloc(MAX(BITSET_WORDS(count), 1), sizeof(uint64_t));
+	if (!page->sections || !page->collapsed)
+	{
+		free(page->sections);
+		free(page->collapsed);
+		page->sections = NULL;
+		page->collapsed = NULL;
+		return 1;
+	}
+
+	int ctl = page->first_ctl;
+	page->section_count = 0;
+	page->collapsed_count = 0;
+	for (int i = 0; i < menu->size; i++)
+	{
+		if (menu->entries[i].type == ENTRY_MIDI_CTL)
+			ctl++;
 		else
-		{
-			*errstr = "Missing text!";
+			page->sections[page->section_count++] = (menu_section){i, ctl};
+	}
+	return 0;
+}
+
+/**
+	Makes another page current. Its contents are swapped
+	with the contents of the current one.
+*/
+static void menu_switch_page(menu_list *menu, int page)
+{
+	menu_page *cur = &menu->pages[menu->page];
+	cur->entries = menu->entries;
+	cur->size = menu->size;
+	cur->capacity = menu->capacity;
+	cur->labels = menu->labels;
+
+	menu_page *next = &menu->pages[page];
+	menu->entries = next->entries;
+	menu->size = next->size;
+	menu->capacity = next->capacity;
+	menu->labels = next->labels;
+	next->entries = NULL;
+	next->size = next->capacity = 0;
+	strpool_init(&next->labels);
+
+	menu->page = page;
+}
+
+/**
+	Appends a new, zeroed entry to the current page
+
+	\returns pointer to the entry or NULL if out of memory
+*/
+static menu_entry *menu_list_append(menu_list *menu)
+{
+	if (menu->size == menu->capacity)
+	{
+		int capacity = menu->capacity ? menu->capacity * 2 : 256;
+		menu_entry *entries = realloc(menu->entries, capacity * sizeof(menu_entry));
+		if (!entries)
+			return NULL;
+		menu->entries = entries;
+		menu->capacity = capacity;
+	}
+
+	menu_entry *ent = &menu->entries[menu->size++];
+	memset(ent, 0, sizeof(*ent));
+	return ent;
+}
+
+/**
+	State of loading the config (or a single page) into the current page
+*/
+typedef struct config_reader
+{
+	menu_list *menu;
+	FILE *errf;
+	long *labels;        //!< Label offsets of the loaded entries - the string block may move until loading is finished
+	long *folded;        //!< Case-folded label offsets (-1 if none)
+	int labels_capacity;
+	char *fold;          //!< Buffer for folding a label
+	size_t fold_size;
+	int page_load;       //!< Loading a page - stop at the next page directive
+	int scanning;        //!< The first page has ended - only look for other pages
+} config_reader;
+
+/**
+	Puts the case-folded version of a label in the string pool,
+	so searching doesn't need to fold the labels over and over again
+
+	\returns offset of the folded label or -1 if out of memory
+*/
+static long config_reader_fold(config_reader *r, long label)
+{
+	strpool *labels = &r->menu->labels;
+	size_t len = strlen(strpool_get(labels, label));
+	if (len + 1 > r->fold_size)
+	{
+		char *fold = realloc(r->fold, len + 1);
+		if (!fold)
 			return -1;
-		}
+		r->fold = fold;
+		r->fold_size = len + 1;
+	}
+
+	// The pool may move while interning, so the label is copied first
+	const char *s = strpool_get(labels, label);
+	for (size_t i = 0; i < len; i++)
+		r->fold[i] = tolower((unsigned char) s[i]);
+	return strpool_intern(labels, r->fold, len);
+}
+
+/**
+	Frees loading buffers
+*/
+static void config_reader_destroy(config_reader *r)
+{
+	free(r->labels);
+	free(r->folded);
+	free(r->fold);
+}
+
+/**
+	Checks if the line is the given directive
+
+	\returns pointer to the directive's argument or NULL if it's not the directive
+*/
+static const char *match_directive(const char *p, const char *name)
+{
+	int len = strlen(name);
+	if (strncmp(p, name, len) || !isspace((unsigned char) p[len]))
+		return NULL;
+	return skip_space(p + len);
+}
 
+/**
+	\returns length of the directive's argument, without the comment and trailing whitespace
+*/
+static int directive_arg_len(const char *arg)
+{
+	const char *end = arg + strcspn(arg, "#");
+	while (end > arg && isspace((unsigned char) end[-1]))
+		end--;
+	return end - arg;
+}
+
+/**
+	Handles a page directive during the initial config load
+
+	\returns 0 on success
+*/
+static int config_reader_add_page(config_reader *r, const char *arg, long offset, int first_line, const char **errstr)
+{
+	menu_list *menu = r->menu;
+	int len = directive_arg_len(arg);
+	if (!len)
+	{
+		*errstr = "Missing page name!";
 		return 1;
 	}
 
-	// If we got here, something is wrong
-	*errstr = "Bad syntax";
-	return -1;
+	char *name = strndup(arg, len);
+	if (!name)
+	{
+		*errstr = "Out of memory!";
+		return 1;
+	}
+
+	// Nothing before the first page directive - it names the first page
+	if (menu->page_count == 1 && !menu->pages[0].name && menu->size == 0)
+	{
+		menu->pages[0].name = name;
+		return 0;
+	}
+
+	menu_page *pages = realloc(menu->pages, (menu->page_count + 1) * sizeof(menu_page));
+	if (!pages)
+	{
+		free(name);
+		*errstr = "Out of memory!";
+		return 1;
+	}
+
+	menu->pages = pages;
+	menu_page *page = &menu->pages[menu->page_count++];
+	memset(page, 0, sizeof(*page));
+	page->name = name;
+	page->offset = offset;
+	page->first_line = first_line;
+	page->cursor = -1;
+	strpool_init(&page->labels);
+
+	r->scanning = 1;
+	return 0;
 }
 
+static int config_reader_read(config_reader *r, FILE *f, const char *path, const char *file, int line_number, int depth);
+
 /**
-	Removes comment from a line
+	Handles a sysex directive - compiles a SysEx template.
+	Templates can be used by all controllers which follow them.
+	An included file may define the same template again, as long
+	as it's identical - it's read again for every page including it.
+
+	\returns 0 on success
 */
-static void remove_comment(char *s)
+static int config_reader_add_sysex(config_reader *r, const char *arg, const char **errpos, const char **errstr)
 {
-	int match = 0;
-	while (*s)
+	menu_list *menu = r->menu;
+	int name_len = 0;
+	while (isalnum((unsigned char) arg[name_len]) || arg[name_len] == '_' || arg[name_len] == '-')
+		name_len++;
+
+	if (!name_len || !isspace((unsigned char) arg[name_len]))
 	{
-		if (*s == '#')
-			match = 1;
-		if (match)
-			*s = 0;
-		s++;
+		*errpos = arg;
+		*errstr = "Expected SysEx template name!";
+		return 1;
 	}
+
+	sysex_template t;
+	if (sysex_template_compile(&t, arg, name_len, arg + name_len, errpos, errstr))
+		return 1;
+
+	int i = menu_find_sysex(menu, t.name, name_len);
+	if (i >= 0)
+	{
+		sysex_template *old = &menu->sysex[i];
+		int same = !memcmp(old->bytes, t.bytes, sizeof(t.bytes)) && old->size == t.size
+			&& old->addr_pos == t.addr_pos && old->addr_len == t.addr_len
+			&& old->value_pos == t.value_pos && old->value_len == t.value_len && old->encoding == t.encoding
+			&& old->checksum_pos == t.checksum_pos && old->checksum == t.checksum;
+		free(t.name);
+		if (same)
+			return 0;
+
+		*errpos = arg;
+		*errstr = "SysEx template already defined!";
+		return 1;
+	}
+
+	sysex_template *templates = realloc(menu->sysex, (menu->sysex_count + 1) * sizeof(sysex_template));
+	if (!templates)
+	{
+		free(t.name);
+		*errstr = "Out of memory!";
+		return 1;
+	}
+	menu->sysex = templates;
+	menu->sysex[menu->sysex_count++] = t;
+	return 0;
+}
+
+/**
+	Handles an include directive. The path is relative to the including file.
+
+	\returns 0 on success
+*/
+static int config_reader_include(config_reader *r, const char *path, const char *arg, int depth, const char **errstr)
+{
+	menu_list *menu = r->menu;
+	int len = directive_arg_len(arg);
+	if (!len)
+	{
+		*errstr = "Missing file name!";
+		return 1;
+	}
+
+	if (depth >= CONFIG_MAX_INCLUDE_DEPTH)
+	{
+		*errstr = "Includes nested too deeply!";
+		return 1;
+	}
+
+	// Resolve the path
+	char *inc_path = NULL;
+	const char *slash = strrchr(path, '/');
+	int err;
+	if (arg[0] == '/' || !slash)
+		err = asprintf(&inc_path, "%.*s", len, arg) < 0;
+	else
+		err = asprintf(&inc_path, "%.*s/%.*s", (int)(slash - path), path, len, arg) < 0;
+
+	char **files = err ? NULL : realloc(menu->files, (menu->file_count + 1) * sizeof(char*));
+	if (!files)
+	{
+		if (!err)
+			free(inc_path);
+		*errstr = "Out of memory!";
+		return 1;
+	}
+	menu->files = files;
+	menu->files[menu->file_count++] = inc_path;
+
+	FILE *f = fopen(inc_path, "rt");
+	if (!f)
+	{
+		*errstr = "Could not open included file!";
+		return 1;
+	}
+
+	err = config_reader_read(r, f, inc_path, inc_path, 1, depth + 1);
+	fclose(f);
+
+	// The error has been reported already
+	if (err)
+		*errstr = NULL;
+	return err;
 }
 
 /**
-	Build menu based on config file
+	Reads config file line by line into the current page
 
-	\todo Fix memory leaks when handling errors
+	\param path Path of the file
+	\param file Included file name for the entries (NULL for the main config)
+	\param line_number Number of the first line read
+	\param depth Include nesting depth (0 for the main config)
+	\returns 0 on success
 */
-menu_entry *build_menu_from_config_file(FILE *f, int *count)
+static int config_reader_read(config_reader *r, FILE *f, const char *path, const char *file, int line_number, int depth)
 {
+	menu_list *menu = r->menu;
 	int fail = 0;
 
-	// Allocate memory for some controllers
-	const int max_menu_size = 512;
-	menu_entry *menu = calloc(max_menu_size, sizeof(menu_entry));
-	int menu_size = 0;
-	
-	// Read file line by line
 	char *line = NULL;
 	size_t line_buffer_len = 0;
-	int line_len;
-	for (int line_number = 1; menu_size < max_menu_size && (line_len = getline(&line, &line_buffer_len, f)) > 0; line_number++)
+	for (; !fail && getline(&line, &line_buffer_len, f) > 0; line_number++)
 	{
-		// Remove the newline, preceding whitespace and comments
-		remove_comment(line);
-		trim_r_whitespace(line);
-		char *text = line + strspn(line, " \t");
-
 		const char *errstr = NULL;
-		int err;
+		const char *errpos = skip_space(line);
+		const char *arg;
+		int err = 0;
+
+		if ((arg = match_directive(errpos, "page")))
+		{
+			if (depth > 0)
+			{
+				errstr = "Pages can only be declared in the main config file!";
+				err = -1;
+			}
+			else if (r->page_load)
+				break;
+			else if (config_reader_add_page(r, arg, ftell(f), line_number + 1, &errstr))
+				err = -1;
+		}
+		else if ((arg = match_directive(errpos, "sysex")))
+		{
+			// Templates in the main config have been read before any page was loaded
+			if ((depth > 0 || !r->page_load) && config_reader_add_sysex(r, arg, &errpos, &errstr))
+				err = -1;
+		}
+		else if (r->scanning)
+			continue;
+		else if ((arg = match_directive(errpos, "include")))
+		{
+			if (config_reader_include(r, path, arg, depth, &errstr))
+				err = -1;
+		}
+		else
+		{
+			menu_entry *ent = menu_list_append(menu);
+			if (menu->capacity > r->labels_capacity)
+			{
+				long *l = realloc(r->labels, menu->capacity * sizeof(long));
+				if (l)
+					r->labels = l;
+				long *fl = realloc(r->folded, menu->capacity * sizeof(long));
+				if (fl)
+					r->folded = fl;
+				if (l && fl)
+					r->labels_capacity = menu->capacity;
+			}
+
+			if (!ent || r->labels_capacity < menu->capacity)
+			{
+				fprintf(r->errf, "Out of memory while loading config!\n");
+				fail = 1;
+				break;
+			}
 
-		err = parse_config_line(&menu[menu_size], text, &errstr);
+			midi_ctl_desc ctl;
+			long *label = &r->labels[menu->size - 1];
+			long *folded = &r->folded[menu->size - 1];
+			*label = *folded = -1;
+			errpos = line;
+			err = parse_config_line(ent, &ctl, label, &menu->labels, line, menu->sysex, menu->sysex_count, &errpos, &errstr);
+
+			if (err > 0 && ent->type == ENTRY_MIDI_CTL)
+			{
+				ent->ctl = midi_ctl_store_add(&menu->ctls, &ctl, menu->size - 1, menu->page);
+				if (*label >= 0)
+					*folded = config_reader_fold(r, *label);
+				if (ent->ctl < 0 || *label < 0 || *folded < 0)
+				{
+					errstr = "Out of memory!";
+					err = -1;
+				}
+			}
+
+			if (err > 0)
+			{
+				ent->file = file;
+				ent->line = line_number;
+			}
+			else
+				menu->size--;
+		}
 
 		if (err < 0)
 		{
-			// Parsing error
-			fprintf(stderr, "Failed parsing config!\nOn line %d: %s\n", line_number, errstr);
+			// Parsing error (errors in included files have been reported already)
+			if (errstr && file)
+				fprintf(r->errf, "Failed parsing config!\nIn %s, line %d, column %d: %s\n", file, line_number, (int)(errpos - line) + 1, errstr);
+			else if (errstr)
+				fprintf(r->errf, "Failed parsing config!\nOn line %d, column %d: %s\n", line_number, (int)(errpos - line) + 1, errstr);
+			else if (file)
+				fprintf(r->errf, "Included from %s, line %d\n", file, line_number);
+			else
+				fprintf(r->errf, "Included from line %d\n", line_number);
 			fail = 1;
-			break;
 		}
-		else
-			menu_size += err;
 	}
 	free(line);
 
+	return fail;
+}
+
+/**
+	Finishes loading entries into the current page - resolves labels,
+	checks controllers added since ctl_start and applies values
+	deferred until they were loaded.
+
+	\returns 0 on success
+*/
+static int config_reader_finish(config_reader *r, int ctl_start)
+{
+	menu_list *menu = r->menu;
+	midi_ctl_store *ctls = &menu->ctls;
+
+	// The string block is complete now
+	for (int i = 0; i < menu->size; i++)
+	{
+		if (r->labels[i] >= 0)
+			menu->entries[i].text = strpool_get(&menu->labels, r->labels[i]);
+		if (r->folded[i] >= 0)
+			menu->entries[i].folded = strpool_get(&menu->labels, r->folded[i]);
+	}
+
 	// Check for duplicated MIDI controllers
-	char found[128] = {0};
-	for (int i = 0; i < menu_size; i++)
+	for (int i = ctl_start; i < ctls->count; i++)
 	{
-		if (menu[i].type == ENTRY_MIDI_CTL)
+		int owner = midi_ctl_index_insert(&menu->index, ctls, i, menu->default_channel);
+		if (owner == -2)
 		{
-			int id = menu[i].midi_ctl.cc;
-			if (found[id])
-			{
-				fprintf(stderr, "Duplicate %d controller found!\n", id);
-				fail = 1;
-				break;
-			}
-			
-			found[id] = 1;
+			fprintf(r->errf, "Out of memory while loading config!\n");
+			return 1;
+		}
+		else if (owner >= 0 && (ctls->flags[i] & MIDI_CTL_SYSEX))
+		{
+			fprintf(r->errf, "Duplicate controller found: SysEx '%s' at address %x!\n", menu->sysex[ctls->cc[i]].name, ctls->sysex_addr[i]);
+			return 1;
+		}
+		else if (owner >= 0)
+		{
+			int addr = midi_ctl_addr(ctls, i);
+			fprintf(r->errf, "Duplicate controller found: %s %d on channel %d!\n", midi_addr_kind(addr), midi_addr_number(addr), midi_ctl_channel(ctls, i, menu->default_channel));
+			return 1;
 		}
 	}
-	
+
+	// There must be something to control
+	if (ctls->count == ctl_start)
+	{
+		if (menu->pages[menu->page].name)
+			fprintf(r->errf, "No controllers defined on page '%s'!\n", menu->pages[menu->page].name);
+		else
+			fprintf(r->errf, "No controllers defined in config!\n");
+		return 1;
+	}
+
+	menu->pages[menu->page].first_ctl = ctl_start;
+	menu->pages[menu->page].ctl_count = ctls->count - ctl_start;
+	if (menu_page_index_sections(menu))
+	{
+		fprintf(r->errf, "Out of memory while loading config!\n");
+		return 1;
+	}
+
+	// Values loaded from a dump before the page was opened
+	for (int i = ctl_start; i < ctls->count; i++)
+	{
+		int addr = midi_ctl_addr(ctls, i);
+		int v = addr < 0
+			? menu_take_deferred_sysex(menu, menu->sysex[ctls->cc[i]].name, ctls->sysex_addr[i])
+			: menu_take_deferred(menu, midi_ctl_channel(ctls, i, menu->default_channel), addr);
+		if (v < 0)
+			continue;
+
+		// Like midi_ctl_set() - only a moved value is sent
+		v = CLAMP(v, ctls->min[i], ctls->max[i]);
+		if (v != ctls->value[i])
+			bitset_set(ctls->changed, i);
+		ctls->value[i] = v;
+	}
+
+	return 0;
+}
+
+/**
+	Build menu based on config file. Only the first page is loaded,
+	the other ones are loaded with menu_open_page().
+
+	\param path Path of the config (included files are relative to it)
+	\param default_channel MIDI channel of controllers without 'chan' key
+	\param errf Stream error messages are written to
+	\returns 0 on success. On failure the menu is left empty.
+*/
+int build_menu_from_config_file(FILE *f, const char *path, int default_channel, menu_list *menu, FILE *errf)
+{
+	if (menu_list_init(menu, path, default_channel))
+	{
+		fprintf(errf, "Out of memory while loading config!\n");
+		return 1;
+	}
+
+	config_reader r = {.menu = menu, .errf = errf};
+	int fail = config_reader_read(&r, f, path, NULL, 1, 0);
+	if (!fail)
+		fail = config_reader_finish(&r, 0);
+	config_reader_destroy(&r);
+
 	// Exit with error
 	if (fail)
 	{
-		for (int i = 0; i < menu_size; i++)
-			free(menu[i].text);
-		free(menu);
-		*count = 0;
-		return NULL;
+		menu_list_destroy(menu);
+		return 1;
 	}
 
-	*count = menu_size;
-	return menu;
+	return 0;
 }
 
 /**
-	Initializes config parser's regex
+	Makes a page current, loading it first if needed.
+	If loading fails, the current page doesn't change.
+
+	\param errf Stream error messages are written to
+	\returns 0 on success
 */
-int config_parser_init(void)
+int menu_open_page(menu_list *menu, int page, FILE *errf)
 {
-	int err = 0;
+	if (!INRANGE(page, 0, menu->page_count - 1))
+		return 1;
 
-	err |= regcomp(&midi_ctl_regex, midi_ctl_regex_str, REG_EXTENDED);
-	assert(!err && "Failed to compile regex for matching ctl lines");
+	int prev = menu->page;
+	menu_page *p = &menu->pages[page];
+	menu_switch_page(menu, page);
+	if (p->loaded)
+		return 0;
 
-	err |= regcomp(&metadata_regex, metadata_regex_str, REG_EXTENDED);
-	assert(!err && "Failed to compile metadata regex");
+	FILE *f = fopen(menu->path, "rt");
+	if (!f || fseek(f, p->offset, SEEK_SET))
+	{
+		fprintf(errf, "Could not open config file: %s\n", strerror(errno));
+		if (f)
+			fclose(f);
+		menu_switch_page(menu, prev);
+		return 1;
+	}
 
-	err |= regcomp(&hrule_regex, hrule_regex_str, REG_EXTENDED);
-	assert(!err && "Failed to compile hrule regex");
+	int ctl_start = menu->ctls.count;
+	int sysex_start = menu->sysex_count;
+	config_reader r = {.menu = menu, .errf = errf, .page_load = 1};
+	int fail = config_reader_read(&r, f, menu->path, NULL, p->first_line, 0);
+	fclose(f);
+	if (!fail)
+		fail = config_reader_finish(&r, ctl_start);
+	config_reader_destroy(&r);
 
-	return err;
+	if (fail)
+	{
+		// Drop everything that has been loaded
+		midi_ctl_store *ctls = &menu->ctls;
+		for (int i = ctl_start; i < ctls->count; i++)
+		{
+			midi_ctl_index_remove(&menu->index, ctls, i, menu->default_channel);
+			bitset_clear(ctls->changed, i);
+			bitset_clear(ctls->force, i);
+		}
+		midi_ctl_store_resize(ctls, ctl_start);
+
+		for (int i = sysex_start; i < menu->sysex_count; i++)
+			free(menu->sysex[i].name);
+		menu->sysex_count = sysex_start;
+
+		free(menu->entries);
+		free(p->sections);
+		free(p->collapsed);
+		strpool_destroy(&menu->labels);
+		menu->entries = NULL;
+		menu->size = menu->capacity = 0;
+		p->sections = NULL;
+		p->collapsed = NULL;
+		p->section_count = p->collapsed_count = 0;
+		menu_switch_page(menu, prev);
+		return 1;
+	}
+
+	p->loaded = 1;
+	return 0;
+}
+
+/**
+	Rewrites controller line so it has the provided CC and channel.
+	Leading CC number or 'cc' metadata key is updated in place, 'chan'
+	key is updated, added or removed (if channel is negative).
+	Name and comment are preserved.
+
+	\returns newly allocated line
+*/
+static char *rebind_ctl_line(const char *line, int cc, int channel)
+{
+	// Split the line into parts
+	const char *comment = strchr(line, '#');
+	if (!comment)
+		comment = line + strlen(line);
+
+	const char *p = line + strspn(line, " \t");
+	int indent = p - line;
+	const char *number = p;
+	p += strspn(p, "0123456789");
+	int number_len = p - number;
+	p += strspn(p, " \t");
+
+	const char *metadata = NULL;
+	int metadata_len = 0;
+	if (*p == '[')
+	{
+		const char *end = memchr(p, ']', comment - p);
+		if (end)
+		{
+			metadata = p + 1;
+			metadata_len = end - metadata;
+			p = end + 1;
+			p += strspn(p, " \t");
+		}
+	}
+
+	const char *name = p;
+	int name_len = comment - name;
+
+	// Rebuild metadata without cc and chan keys
+	char *md = NULL;
+	size_t md_size = 0;
+	FILE *mf = open_memstream(&md, &md_size);
+	int md_cnt = 0;
+	int cc_in_metadata = 0;
+	for (int i = 0; i < metadata_len;)
+	{
+		int len = strcspn(metadata + i, ",");
+		len = MIN(len, metadata_len - i);
+		const char *item = metadata + i;
+		i += len + 1;
+
+		// Trim the item
+		while (len > 0 && isspace(*item)) item++, len--;
+		while (len > 0 && isspace(item[len - 1])) len--;
+		if (len == 0)
+			continue;
+
+		int key_len = strcspn(item, " \t=");
+		if (key_len == 2 && !strncmp(item, "cc", 2))
+		{
+			cc_in_metadata = 1;
+			fprintf(mf, "%scc = %d", md_cnt++ ? ", " : "", cc);
+		}
+		else if (key_len == 4 && !strncmp(item, "chan", 4))
+			continue;
+		else
+			fprintf(mf, "%s%.*s", md_cnt++ ? ", " : "", len, item);
+	}
+
+	if (!cc_in_metadata && !number_len)
+		fprintf(mf, "%scc = %d", md_cnt++ ? ", " : "", cc);
+	if (channel >= 0)
+		fprintf(mf, "%schan = %d", md_cnt++ ? ", " : "", channel);
+	fclose(mf);
+
+	// Reassemble the line
+	char *out = NULL;
+	size_t out_size = 0;
+	FILE *f = open_memstream(&out, &out_size);
+	fprintf(f, "%.*s", indent, line);
+	if (number_len && !cc_in_metadata)
+		fprintf(f, "%d ", cc);
+	if (md_cnt)
+		fprintf(f, "[%s] ", md);
+	fprintf(f, "%.*s%s", name_len, name, comment);
+	fclose(f);
+
+	free(md);
+	return out;
 }
 
-void config_parser_destroy(void)
+/**
+	Changes CC and channel of a controller defined on provided
+	line of the config file. The file is replaced atomically.
+	If the path is a symlink, the file it points to is replaced.
+	The file keeps its permissions.
+
+	\returns 0 on success
+*/
+int config_rebind_ctl(const char *path, int line_number, int cc, int channel)
 {
-	regfree(&midi_ctl_regex);
-	regfree(&metadata_regex);
-	regfree(&hrule_regex);
-}
\ No newline at end of file
+	char *real_path = realpath(path, NULL);
+	if (!real_path)
+		return 1;
+
+	FILE *f = fopen(real_path, "rt");
+	if (!f)
+	{
+		free(real_path);
+		return 1;
+	}
+
+	// The temporary file has to be on the same filesystem for rename()
+	struct stat st;
+	char *tmp_path = NULL;
+	if (fstat(fileno(f), &st) || asprintf(&tmp_path, "%s.XXXXXX", real_path) < 0)
+	{
+		free(real_path);
+		fclose(f);
+		return 1;
+	}
+
+	int fd = mkstemp(tmp_path);
+	FILE *out = fd < 0 ? NULL : fdopen(fd, "wt");
+	if (!out)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+			unlink(tmp_path);
+		}
+		free(tmp_path);
+		free(real_path);
+		fclose(f);
+		return 1;
+	}
+
+	char *line = NULL;
+	size_t line_buffer_len = 0;
+	int found = 0;
+	int err = fchmod(fd, st.st_mode & 07777) != 0;
+	for (int n = 1; !err && getline(&line, &line_buffer_len, f) > 0; n++)
+	{
+		if (n == line_number)
+		{
+			int has_newline = strchr(line, '\n') != NULL;
+			trim_newline(line);
+			char *new_line = rebind_ctl_line(line, cc, channel);
+			if (!new_line)
+			{
+				err = 1;
+				break;
+			}
+			fprintf(out, "%s%s", new_line, has_newline ? "\n" : "");
+			free(new_line);
+			found = 1;
+		}
+		else
+			fputs(line, out);
+	}
+	free(line);
+	fclose(f);
+
+	err |= fclose(out) != 0 || !found;
+	if (!err)
+		err = rename(tmp_path, real_path) != 0;
+	if (err)
+		unlink(tmp_path);
+
+	free(tmp_path);
+	free(real_path);
+	return err;
+}
@@ -4,8 +4,20 @@
 #include <stdio.h>
 #include "midictl.h"
 
-extern menu_entry *build_menu_from_config_file(FILE *f, int *count);
-extern int config_parser_init(void);
-extern void config_parser_destroy(void);
+extern int build_menu_from_config_file(FILE *f, const char *path, int default_channel, menu_list *menu, FILE *errf);
+extern int menu_open_page(menu_list *menu, int page, FILE *errf);
+extern int menu_find_page(const menu_list *menu, const char *name);
+extern int menu_find_sysex(const menu_list *menu, const char *name, int name_len);
+extern int menu_list_init(menu_list *menu, const char *path, int default_channel);
+extern int menu_list_cacheable(const menu_list *menu);
+extern int menu_page_index_sections(menu_list *menu);
+extern const menu_entry *menu_ctl_entry(const menu_list *menu, int id);
+extern int menu_defer_value(menu_list *menu, int channel, int addr, int value);
+extern int menu_take_deferred(menu_list *menu, int channel, int addr);
+extern int menu_defer_sysex(menu_list *menu, const char *name, int name_len, int addr, int value);
+extern int menu_take_deferred_sysex(menu_list *menu, const char *name, int addr);
+extern int menu_copy_deferred(menu_list *dst, const menu_list *src);
+extern void menu_list_destroy(menu_list *menu);
+extern int config_rebind_ctl(const char *path, int line_number, int cc, int channel);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,296 @@
+#include "config_watch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include "config_cache.h"
+#include "config_parser.h"
+#include "utils.h"
+
+/**
+	Reads all pending inotify events
+
+	\returns whether any of them concerns the config file
+*/
+static int config_watch_read_events(config_watch *watch)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int changed = 0;
+	ssize_t len;
+
+	while ((len = read(watch->inotify_fd, buf, sizeof(buf))) > 0)
+	{
+		for (char *p = buf; p < buf + len;)
+		{
+			const struct inotify_event *ev = (const struct inotify_event*) p;
+			if (ev->len && !strcmp(ev->name, watch->name))
+				changed = 1;
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+
+	return changed;
+}
+
+/**
+	Parses the config and the pages opened in the UI and hands
+	the result over to the UI. Pages which can't be opened don't
+	fail the reload - their controllers count as removed.
+*/
+static void config_watch_reload(config_watch *watch)
+{
+	menu_list menu;
+	char *error = NULL;
+	size_t error_size = 0;
+	FILE *errf = open_memstream(&error, &error_size);
+	if (!errf)
+		return;
+
+	int err = config_load(watch->path, watch->default_channel, &menu, errf);
+	if (!err)
+	{
+		// Find the pages first, so the UI isn't held up while they're parsed
+		int *pages = NULL;
+		int count = 0;
+		pthread_mutex_lock(&watch->mutex);
+		pages = malloc(MAX(watch->page_count, 1) * sizeof(int));
+		for (int i = 0; pages && i < watch->page_count; i++)
+			pages[count++] = menu_find_page(&menu, watch->pages[i]);
+		pthread_mutex_unlock(&watch->mutex);
+
+		for (int i = 0; i < count; i++)
+			if (pages[i] >= 0)
+				menu_open_page(&menu, pages[i], errf);
+		menu_open_page(&menu, 0, errf);
+		free(pages);
+	}
+	fclose(errf);
+
+	// Messages are shown in one line
+	for (char *p = error; p && *p; p++)
+		if (*p == '\n')
+			*p = p[1] ? ' ' : 0;
+
+	if (error && !*error)
+	{
+		free(error);
+		error = NULL;
+	}
+
+	// Replace the previous result if the UI hasn't picked it up yet
+	pthread_mutex_lock(&watch->mutex);
+	if (watch->ready)
+	{
+		free(watch->error);
+		if (!watch->failed)
+			menu_list_destroy(&watch->menu);
+	}
+	watch->ready = 1;
+	watch->failed = err;
+	watch->error = error;
+	if (!err)
+		watch->menu = menu;
+	pthread_mutex_unlock(&watch->mutex);
+
+	uint64_t one = 1;
+	if (write(watch->notify_fd, &one, sizeof(one)) < 0)
+		perror("config_watch: write() to eventfd failed");
+}
+
+/**
+	The watcher thread
+*/
+static void *config_watch_thread(void *arg)
+{
+	config_watch *watch = arg;
+	struct pollfd pfds[2] = {
+		{.fd = watch->stop_fd, .events = POLLIN},
+		{.fd = watch->inotify_fd, .events = POLLIN},
+	};
+
+	int pending = 0;
+	while (1)
+	{
+		// Once the config has changed, wait until it settles
+		int n = poll(pfds, 2, pending ? CONFIG_WATCH_SETTLE_MS : -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("config_watch: poll() failed");
+			break;
+		}
+
+		if (pfds[0].revents)
+			break;
+
+		if (n == 0)
+		{
+			config_watch_reload(watch);
+			pending = 0;
+		}
+		else if (pfds[1].revents & POLLIN)
+			pending |= config_watch_read_events(watch);
+	}
+
+	return NULL;
+}
+
+/**
+	Picks up the config reloaded by the watcher thread.
+	On success, the new menu is returned via menu. A malloc'ed
+	error message is returned via error if the reload failed or some
+	pages couldn't be opened (NULL otherwise).
+
+	\returns 1 if a new menu is returned, -1 if the reload failed
+		and 0 if there was no result waiting
+*/
+int config_watch_take(config_watch *watch, menu_list *menu, char **error)
+{
+	pthread_mutex_lock(&watch->mutex);
+	int ready = watch->ready;
+	if (ready)
+	{
+		*error = watch->error;
+		if (!watch->failed)
+			*menu = watch->menu;
+		else
+			ready = -1;
+		watch->ready = 0;
+		watch->error = NULL;
+	}
+	pthread_mutex_unlock(&watch->mutex);
+
+	return ready;
+}
+
+/**
+	Tells the watcher which pages are open in the UI (UI thread only),
+	so they're loaded along with the config when it changes
+*/
+void config_watch_set_pages(config_watch *watch, const menu_list *menu)
+{
+	if (!watch->mutex_ready)
+		return;
+
+	char **pages = calloc(menu->page_count, sizeof(char*));
+	int count = 0;
+	for (int i = 1; pages && i < menu->page_count; i++)
+		if (menu->pages[i].loaded && menu->pages[i].name && !(pages[count++] = strdup(menu->pages[i].name)))
+			count--;
+
+	pthread_mutex_lock(&watch->mutex);
+	for (int i = 0; i < watch->page_count; i++)
+		free(watch->pages[i]);
+	free(watch->pages);
+	watch->pages = pages;
+	watch->page_count = count;
+	pthread_mutex_unlock(&watch->mutex);
+}
+
+/**
+	Starts watching the config file
+
+	\param default_channel MIDI channel the config is loaded for
+*/
+int config_watch_init(config_watch *watch, const char *path, int default_channel)
+{
+	memset(watch, 0, sizeof(*watch));
+	watch->default_channel = default_channel;
+	watch->inotify_fd = -1;
+	watch->notify_fd = -1;
+	watch->stop_fd = -1;
+	pthread_mutex_init(&watch->mutex, NULL);
+	watch->mutex_ready = 1;
+
+	// dirname() and basename() may modify their arguments
+	watch->path = strdup(path);
+	char *dir = strdup(path);
+	char *name = strdup(path);
+	if (!watch->path || !dir || !name)
+	{
+		free(dir);
+		free(name);
+		config_watch_destroy(watch);
+		return 1;
+	}
+	watch->dir = strdup(dirname(dir));
+	watch->name = watch->path + strlen(watch->path) - strlen(basename(name));
+	free(dir);
+	free(name);
+
+	watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	watch->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	watch->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (watch->inotify_fd < 0 || watch->notify_fd < 0 || watch->stop_fd < 0 || !watch->dir)
+	{
+		perror("config_watch: init failed");
+		config_watch_destroy(watch);
+		return 1;
+	}
+
+	// Editors usually replace the file rather than write to it
+	if (inotify_add_watch(watch->inotify_fd, watch->dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		perror("config_watch: inotify_add_watch() failed");
+		config_watch_destroy(watch);
+		return 1;
+	}
+
+	int err = pthread_create(&watch->thread, NULL, config_watch_thread, watch);
+	if (err)
+	{
+		fprintf(stderr, "Failed to start config watcher thread: %s\n", strerror(err));
+		config_watch_destroy(watch);
+		return 1;
+	}
+
+	watch->running = 1;
+	return 0;
+}
+
+/**
+	Stops the watcher thread. Also safe to call on a watcher
+	which failed to initialize.
+*/
+void config_watch_destroy(config_watch *watch)
+{
+	if (watch->running)
+	{
+		uint64_t one = 1;
+		if (write(watch->stop_fd, &one, sizeof(one)) < 0)
+			perror("config_watch: write() to eventfd failed");
+		pthread_join(watch->thread, NULL);
+	}
+
+	if (watch->ready)
+	{
+		free(watch->error);
+		if (!watch->failed)
+			menu_list_destroy(&watch->menu);
+	}
+
+	for (int i = 0; i < watch->page_count; i++)
+		free(watch->pages[i]);
+	free(watch->pages);
+
+	if (watch->inotify_fd >= 0)
+		close(watch->inotify_fd);
+	if (watch->notify_fd >= 0)
+		close(watch->notify_fd);
+	if (watch->stop_fd >= 0)
+		close(watch->stop_fd);
+
+	if (watch->mutex_ready)
+		pthread_mutex_destroy(&watch->mutex);
+	free(watch->path);
+	free(watch->dir);
+	memset(watch, 0, sizeof(*watch));
+	watch->inotify_fd = watch->notify_fd = watch->stop_fd = -1;
+}
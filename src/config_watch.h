@@ -0,0 +1,47 @@
+#ifndef MIDICTL_CONFIG_WATCH_H
+#define MIDICTL_CONFIG_WATCH_H
+
+#include <pthread.h>
+#include "midictl.h"
+
+/**
+	How long the config has to stay unchanged before it's reloaded (ms).
+	Editors often write files in several steps.
+*/
+#define CONFIG_WATCH_SETTLE_MS 50
+
+/**
+	Config file watcher. The config is watched with inotify and
+	re-parsed in a background thread whenever it changes, along with
+	the pages the UI has opened (see config_watch_set_pages()).
+	The result is picked up by the UI with config_watch_take().
+*/
+typedef struct config_watch
+{
+	char *path;
+	char *dir;        //!< Directory containing the config - watched, so replacing the file is noticed too
+	const char *name; //!< File name part of the path
+	int default_channel;
+
+	pthread_t thread;
+	int running;
+	int inotify_fd;
+	int notify_fd;    //!< eventfd signalled when a reloaded menu is waiting
+	int stop_fd;      //!< eventfd used to stop the thread
+
+	pthread_mutex_t mutex;
+	int mutex_ready;  //!< The mutex is initialized - the watcher may be destroyed twice
+	int ready;        //!< A result is waiting (guarded by mutex)
+	int failed;       //!< The reload failed (guarded by mutex)
+	menu_list menu;   //!< The reloaded menu (guarded by mutex)
+	char *error;      //!< Why the reload failed or why some pages couldn't be opened (guarded by mutex)
+	char **pages;     //!< Names of the pages opened in the UI (guarded by mutex)
+	int page_count;
+} config_watch;
+
+extern int config_watch_take(config_watch *watch, menu_list *menu, char **error);
+extern void config_watch_set_pages(config_watch *watch, const menu_list *menu);
+extern int config_watch_init(config_watch *watch, const char *path, int default_channel);
+extern void config_watch_destroy(config_watch *watch);
+
+#endif
@@ -0,0 +1,361 @@
+#include "ctl_store.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+	Resizes one of the store's arrays. New elements are zeroed.
+*/
+static int grow_array(void **arr, size_t elem_size, size_t old_count, size_t new_count)
+{
+	void *p = realloc(*arr, new_count * elem_size);
+	if (!p)
+		return 1;
+
+	memset((char*) p + old_count * elem_size, 0, (new_count - old_count) * elem_size);
+	*arr = p;
+	return 0;
+}
+
+/**
+	Makes room for at least the given number of controllers
+*/
+static int midi_ctl_store_grow(midi_ctl_store *store, int min_capacity)
+{
+	int old = store->capacity;
+	int capacity = old ? old * 2 : 256;
+	while (capacity < min_capacity)
+		capacity *= 2;
+	int err = 0;
+
+	err |= grow_array((void**) &store->cc, sizeof(store->cc[0]), old, capacity);
+	err |= grow_array((void**) &store->sysex_addr, sizeof(store->sysex_addr[0]), old, capacity);
+	err |= grow_array((void**) &store->channel, sizeof(store->channel[0]), old, capacity);
+	err |= grow_array((void**) &store->value, sizeof(store->value[0]), old, capacity);
+	err |= grow_array((void**) &store->min, sizeof(store->min[0]), old, capacity);
+	err |= grow_array((void**) &store->max, sizeof(store->max[0]), old, capacity);
+	err |= grow_array((void**) &store->def, sizeof(store->def[0]), old, capacity);
+	err |= grow_array((void**) &store->flags, sizeof(store->flags[0]), old, capacity);
+	err |= grow_array((void**) &store->entry, sizeof(store->entry[0]), old, capacity);
+	err |= grow_array((void**) &store->page, sizeof(store->page[0]), old, capacity);
+	err |= grow_array((void**) &store->activity, sizeof(store->activity[0]), old, capacity);
+	err |= grow_array((void**) &store->changed, sizeof(uint64_t), BITSET_WORDS(old), BITSET_WORDS(capacity));
+	err |= grow_array((void**) &store->force, sizeof(uint64_t), BITSET_WORDS(old), BITSET_WORDS(capacity));
+
+	// Arrays which have been grown successfully stay valid,
+	// so the capacity can only be updated if all of them were
+	if (!err)
+		store->capacity = capacity;
+	return err;
+}
+
+/**
+	Adds a controller to the store. The value is set to the default
+	one (or the middle of the range) and the controller is marked as
+	changed if it's supposed to be sent on startup.
+
+	\returns controller ID or -1 if out of memory
+*/
+int midi_ctl_store_add(midi_ctl_store *store, const midi_ctl_desc *desc, int entry, int page)
+{
+	if (store->count == store->capacity && midi_ctl_store_grow(store, store->count + 1))
+		return -1;
+
+	int id = store->count++;
+	store->cc[id] = desc->cc;
+	store->sysex_addr[id] = desc->sysex_addr;
+	store->channel[id] = desc->channel;
+	store->min[id] = desc->min;
+	store->max[id] = desc->max;
+	store->def[id] = desc->def;
+	store->value[id] = desc->def < 0 ? (desc->min + desc->max) / 2 : desc->def;
+	store->flags[id] = (desc->slider ? MIDI_CTL_SLIDER : 0) | (desc->hires ? MIDI_CTL_HIRES : 0) | desc->param;
+	store->entry[id] = entry;
+	store->page[id] = page;
+	store->activity[id] = 0;
+	if (desc->update)
+		bitset_set(store->changed, id);
+	return id;
+}
+
+/**
+	Sets the number of controllers, making room for them if needed.
+	The contents of the added controllers are not initialized.
+
+	\returns 0 on success
+*/
+int midi_ctl_store_resize(midi_ctl_store *store, int count)
+{
+	if (count > store->capacity && midi_ctl_store_grow(store, count))
+		return 1;
+
+	store->count = count;
+	return 0;
+}
+
+void midi_ctl_store_destroy(midi_ctl_store *store)
+{
+	free(store->cc);
+	free(store->sysex_addr);
+	free(store->channel);
+	free(store->value);
+	free(store->min);
+	free(store->max);
+	free(store->def);
+	free(store->flags);
+	free(store->entry);
+	free(store->page);
+	free(store->activity);
+	free(store->changed);
+	free(store->force);
+	memset(store, 0, sizeof(*store));
+}
+
+/**
+	\returns slot the key should be looked for at first
+*/
+static inline int midi_ctl_map_slot(const midi_ctl_map *map, uint64_t key)
+{
+	return (key * 0x9e3779b97f4a7c15ull) >> 32 & (map->capacity - 1);
+}
+
+/**
+	\returns pointer to the value stored for the key or NULL if there's none
+*/
+int *midi_ctl_map_find(const midi_ctl_map *map, uint64_t key)
+{
+	if (!map->count)
+		return NULL;
+
+	for (int i = midi_ctl_map_slot(map, key); map->keys[i] != MIDI_CTL_MAP_EMPTY; i = (i + 1) & (map->capacity - 1))
+		if (map->keys[i] == key)
+			return &map->values[i];
+	return NULL;
+}
+
+/**
+	Rehashes the map into a table twice as big
+*/
+static int midi_ctl_map_grow(midi_ctl_map *map)
+{
+	midi_ctl_map big = {.capacity = map->capacity ? map->capacity * 2 : 64};
+	big.keys = malloc(big.capacity * sizeof(big.keys[0]));
+	big.values = malloc(big.capacity * sizeof(big.values[0]));
+	if (!big.keys || !big.values)
+	{
+		free(big.keys);
+		free(big.values);
+		return 1;
+	}
+
+	memset(big.keys, 0xff, big.capacity * sizeof(big.keys[0]));
+	for (int i = 0; i < map->capacity; i++)
+		if (map->keys[i] != MIDI_CTL_MAP_EMPTY)
+			midi_ctl_map_put(&big, map->keys[i], map->values[i]);
+
+	midi_ctl_map_destroy(map);
+	*map = big;
+	return 0;
+}
+
+/**
+	Sets the value for a key
+
+	\returns 0 on success, non-zero if out of memory
+*/
+int midi_ctl_map_put(midi_ctl_map *map, uint64_t key, int value)
+{
+	int *v = midi_ctl_map_find(map, key);
+	if (v)
+	{
+		*v = value;
+		return 0;
+	}
+
+	// Kept at most half full
+	if (2 * (map->count + 1) > map->capacity && midi_ctl_map_grow(map))
+		return 1;
+
+	int i = midi_ctl_map_slot(map, key);
+	while (map->keys[i] != MIDI_CTL_MAP_EMPTY)
+		i = (i + 1) & (map->capacity - 1);
+	map->keys[i] = key;
+	map->values[i] = value;
+	map->count++;
+	return 0;
+}
+
+/**
+	Removes a key. The following entries are moved back, so lookups
+	never have to skip deleted slots.
+*/
+void midi_ctl_map_remove(midi_ctl_map *map, uint64_t key)
+{
+	int *v = midi_ctl_map_find(map, key);
+	if (!v)
+		return;
+
+	int mask = map->capacity - 1;
+	int hole = v - map->values;
+	for (int i = (hole + 1) & mask; map->keys[i] != MIDI_CTL_MAP_EMPTY; i = (i + 1) & mask)
+	{
+		// Entries which can't be found from the hole stay in place
+		int home = midi_ctl_map_slot(map, map->keys[i]);
+		if (((i - home) & mask) < ((i - hole) & mask))
+			continue;
+
+		map->keys[hole] = map->keys[i];
+		map->values[hole] = map->values[i];
+		hole = i;
+	}
+
+	map->keys[hole] = MIDI_CTL_MAP_EMPTY;
+	map->count--;
+}
+
+/**
+	Replaces contents of dst with a copy of src
+
+	\returns 0 on success
+*/
+int midi_ctl_map_copy(midi_ctl_map *dst, const midi_ctl_map *src)
+{
+	midi_ctl_map_destroy(dst);
+	if (!src->capacity)
+		return 0;
+
+	dst->keys = malloc(src->capacity * sizeof(dst->keys[0]));
+	dst->values = malloc(src->capacity * sizeof(dst->values[0]));
+	if (!dst->keys || !dst->values)
+	{
+		midi_ctl_map_destroy(dst);
+		return 1;
+	}
+
+	memcpy(dst->keys, src->keys, src->capacity * sizeof(dst->keys[0]));
+	memcpy(dst->values, src->values, src->capacity * sizeof(dst->values[0]));
+	dst->capacity = src->capacity;
+	dst->count = src->count;
+	return 0;
+}
+
+void midi_ctl_map_clear(midi_ctl_map *map)
+{
+	if (map->count)
+		memset(map->keys, 0xff, map->capacity * sizeof(map->keys[0]));
+	map->count = 0;
+}
+
+void midi_ctl_map_destroy(midi_ctl_map *map)
+{
+	free(map->keys);
+	free(map->values);
+	memset(map, 0, sizeof(*map));
+}
+
+/**
+	Sets up an empty index
+*/
+void midi_ctl_index_init(midi_ctl_index *index)
+{
+	memset(&index->params, 0, sizeof(index->params));
+	memset(&index->sysex, 0, sizeof(index->sysex));
+	midi_ctl_index_clear(index);
+}
+
+void midi_ctl_index_clear(midi_ctl_index *index)
+{
+	memset(index->cc, 0xff, sizeof(index->cc));
+	midi_ctl_map_clear(&index->params);
+	midi_ctl_map_clear(&index->sysex);
+}
+
+void midi_ctl_index_destroy(midi_ctl_index *index)
+{
+	midi_ctl_map_destroy(&index->params);
+	midi_ctl_map_destroy(&index->sysex);
+}
+
+/**
+	Adds a controller to the index, unless another one
+	already has the same channel and address. 14-bit CC controllers
+	take both the MSB and the LSB CC. SysEx controllers are indexed by
+	template and address, regardless of the channel.
+
+	\returns ID of the controller already there, -1 if added or
+		-2 if out of memory
+*/
+int midi_ctl_index_insert(midi_ctl_index *index, const midi_ctl_store *store, int id, int default_channel)
+{
+	int ch = midi_ctl_channel(store, id, default_channel);
+	int addr = midi_ctl_addr(store, id);
+	if (addr < 0)
+	{
+		int owner = midi_ctl_index_find_sysex(index, store->cc[id], store->sysex_addr[id]);
+		if (owner >= 0 && owner != id)
+			return owner;
+		return midi_ctl_map_put(&index->sysex, midi_ctl_sysex_key(store->cc[id], store->sysex_addr[id]), id) ? -2 : -1;
+	}
+
+	int owner = midi_ctl_index_find(index, ch, addr);
+	if (owner >= 0 && owner != id)
+		return owner;
+
+	if (addr >= MIDI_CCS)
+		return midi_ctl_map_put(&index->params, midi_ctl_key(ch, addr), id) ? -2 : -1;
+
+	int *row = index->cc[ch];
+	int lsb = (store->flags[id] & MIDI_CTL_HIRES) ? addr + MIDI_CTL_LSB_OFFSET : -1;
+	if (lsb >= 0 && row[lsb] >= 0 && row[lsb] != id)
+		return row[lsb];
+
+	row[addr] = id;
+	if (lsb >= 0)
+		row[lsb] = id;
+	return -1;
+}
+
+/**
+	Removes a controller from the index (before its channel or CC changes)
+*/
+void midi_ctl_index_remove(midi_ctl_index *index, const midi_ctl_store *store, int id, int default_channel)
+{
+	int ch = midi_ctl_channel(store, id, default_channel);
+	int addr = midi_ctl_addr(store, id);
+	if (addr < 0)
+	{
+		if (midi_ctl_index_find_sysex(index, store->cc[id], store->sysex_addr[id]) == id)
+			midi_ctl_map_remove(&index->sysex, midi_ctl_sysex_key(store->cc[id], store->sysex_addr[id]));
+		return;
+	}
+
+	if (addr >= MIDI_CCS)
+	{
+		if (midi_ctl_index_find(index, ch, addr) == id)
+			midi_ctl_map_remove(&index->params, midi_ctl_key(ch, addr));
+		return;
+	}
+
+	int *row = index->cc[ch];
+	if (row[addr] == id)
+		row[addr] = -1;
+	if ((store->flags[id] & MIDI_CTL_HIRES) && row[addr + MIDI_CTL_LSB_OFFSET] == id)
+		row[addr + MIDI_CTL_LSB_OFFSET] = -1;
+}
+
+/**
+	Builds the index of all controllers in the store
+
+	\returns ID of the first duplicated controller, -1 if there are none
+		or -2 if out of memory
+*/
+int midi_ctl_index_build(midi_ctl_index *index, const midi_ctl_store *store, int default_channel)
+{
+	midi_ctl_index_clear(index);
+	for (int i = 0; i < store->count; i++)
+	{
+		int owner = midi_ctl_index_insert(index, store, i, default_channel);
+		if (owner != -1)
+			return owner == -2 ? -2 : i;
+	}
+	return -1;
+}
@@ -0,0 +1,234 @@
+#ifndef MIDICTL_CTL_STORE_H
+#define MIDICTL_CTL_STORE_H
+
+#include <stdint.h>
+
+/**
+	Number of MIDI channels and controllers per channel
+*/
+#define MIDI_CHANNELS 16
+#define MIDI_CCS 128
+
+/**
+	Number of NRPN (and RPN) parameter numbers
+*/
+#define MIDI_PARAMS 16384
+
+/**
+	Controller addresses - CC numbers come first, followed by
+	NRPN and RPN parameter numbers
+*/
+#define MIDI_ADDR_NRPN MIDI_CCS
+#define MIDI_ADDR_RPN  (MIDI_ADDR_NRPN + MIDI_PARAMS)
+#define MIDI_ADDRS     (MIDI_ADDR_RPN + MIDI_PARAMS)
+
+/**
+	midi_ctl_store.flags bits
+*/
+#define MIDI_CTL_SLIDER 1 //!< Slider should be displayed
+#define MIDI_CTL_HIRES  2 //!< 14-bit controller - MSB on the CC, LSB on CC + MIDI_CTL_LSB_OFFSET
+#define MIDI_CTL_NRPN   4 //!< 'cc' is an NRPN parameter number
+#define MIDI_CTL_RPN    8 //!< 'cc' is an RPN parameter number
+#define MIDI_CTL_SYSEX 16 //!< 'cc' is a SysEx template index, the address is in 'sysex_addr'
+
+/**
+	14-bit controllers use CC 0-31 for the MSB and CC 32-63 for the LSB
+*/
+#define MIDI_CTL_LSB_OFFSET 32
+#define MIDI_CTL_HIRES_MAX 16383
+
+/**
+	Controller definition, as read from the config
+*/
+typedef struct midi_ctl_desc
+{
+	int cc;      //!< CC number or (N)RPN parameter number
+	int channel; //!< MIDI channel (-1 to use default)
+	int min;
+	int max;
+	int def;     //!< Default value (-1 to ignore)
+	int slider;  //!< Should slider be displayed
+	int update;  //!< Send the value on startup
+	int hires;   //!< 14-bit controller (CC and CC + 32 or 14-bit data entry)
+	int param;   //!< MIDI_CTL_NRPN, MIDI_CTL_RPN or MIDI_CTL_SYSEX for parameters, 0 for CCs
+	int sysex_addr; //!< SysEx address (MIDI_CTL_SYSEX only)
+} midi_ctl_desc;
+
+/**
+	State of all controllers, kept in parallel arrays indexed by controller ID.
+	Bulk operations only touch the arrays they need.
+*/
+typedef struct midi_ctl_store
+{
+	int count;
+	int capacity;
+
+	uint16_t *cc;       //!< CC number, (N)RPN parameter number or SysEx template index
+	int32_t *sysex_addr; //!< SysEx address (MIDI_CTL_SYSEX only)
+	int8_t *channel;    //!< MIDI channel (-1 to use default)
+	int16_t *value;
+	int16_t *min;
+	int16_t *max;
+	int16_t *def;       //!< Default value (-1 to ignore)
+	uint8_t *flags;     //!< MIDI_CTL_* flags
+	int *entry;         //!< Menu entry displaying the controller
+	int16_t *page;      //!< Menu page the entry is on
+	uint64_t *activity; //!< When the value was last received from the device (monotonic ns, 0 if never)
+
+	uint64_t *changed;  //!< Bitset - the value needs to be handed over to the sender's pending output
+	uint64_t *force;    //!< Bitset - send even if the device already got this value
+} midi_ctl_store;
+
+/**
+	Open addressing hash map from 64-bit keys to ints, used where the
+	key space is too big for a plain table ((N)RPN and SysEx addresses).
+	Nothing is allocated until the first insert.
+*/
+typedef struct midi_ctl_map
+{
+	uint64_t *keys; //!< MIDI_CTL_MAP_EMPTY for free slots
+	int *values;
+	int capacity;   //!< Power of two
+	int count;
+} midi_ctl_map;
+
+#define MIDI_CTL_MAP_EMPTY UINT64_MAX
+
+/**
+	(channel, address) -> controller lookup table. CCs are looked up
+	directly, parameters and SysEx controllers go through hash maps.
+*/
+typedef struct midi_ctl_index
+{
+	int cc[MIDI_CHANNELS][MIDI_CCS]; //!< Controller ID or -1
+	midi_ctl_map params;             //!< (N)RPN controllers, keyed with midi_ctl_key()
+	midi_ctl_map sysex;              //!< SysEx controllers, keyed with midi_ctl_sysex_key()
+} midi_ctl_index;
+
+extern int midi_ctl_store_add(midi_ctl_store *store, const midi_ctl_desc *desc, int entry, int page);
+extern int midi_ctl_store_resize(midi_ctl_store *store, int count);
+extern void midi_ctl_store_destroy(midi_ctl_store *store);
+
+extern int *midi_ctl_map_find(const midi_ctl_map *map, uint64_t key);
+extern int midi_ctl_map_put(midi_ctl_map *map, uint64_t key, int value);
+extern void midi_ctl_map_remove(midi_ctl_map *map, uint64_t key);
+extern int midi_ctl_map_copy(midi_ctl_map *dst, const midi_ctl_map *src);
+extern void midi_ctl_map_clear(midi_ctl_map *map);
+extern void midi_ctl_map_destroy(midi_ctl_map *map);
+
+extern void midi_ctl_index_init(midi_ctl_index *index);
+extern void midi_ctl_index_clear(midi_ctl_index *index);
+extern void midi_ctl_index_destroy(midi_ctl_index *index);
+extern int midi_ctl_index_insert(midi_ctl_index *index, const midi_ctl_store *store, int id, int default_channel);
+extern void midi_ctl_index_remove(midi_ctl_index *index, const midi_ctl_store *store, int id, int default_channel);
+extern int midi_ctl_index_build(midi_ctl_index *index, const midi_ctl_store *store, int default_channel);
+
+/**
+	\returns MIDI channel the controller is sent on
+*/
+static inline int midi_ctl_channel(const midi_ctl_store *store, int id, int default_channel)
+{
+	return store->channel[id] < 0 ? default_channel : store->channel[id];
+}
+
+/**
+	\returns highest CC (or parameter) number the controller can use
+*/
+static inline int midi_ctl_max_cc(const midi_ctl_store *store, int id)
+{
+	if (store->flags[id] & (MIDI_CTL_NRPN | MIDI_CTL_RPN))
+		return MIDI_PARAMS - 1;
+	return store->flags[id] & MIDI_CTL_HIRES ? MIDI_CTL_LSB_OFFSET - 1 : MIDI_CCS - 1;
+}
+
+/**
+	\returns address of the controller (see MIDI_ADDR_*) or -1 for SysEx
+		controllers, which are indexed by template and address instead
+*/
+static inline int midi_ctl_addr(const midi_ctl_store *store, int id)
+{
+	if (store->flags[id] & MIDI_CTL_SYSEX)
+		return -1;
+	if (store->flags[id] & MIDI_CTL_NRPN)
+		return MIDI_ADDR_NRPN + store->cc[id];
+	if (store->flags[id] & MIDI_CTL_RPN)
+		return MIDI_ADDR_RPN + store->cc[id];
+	return store->cc[id];
+}
+
+/**
+	\returns hash map key for given channel and address
+*/
+static inline uint64_t midi_ctl_key(int channel, int addr)
+{
+	return (uint64_t) channel * MIDI_ADDRS + addr;
+}
+
+/**
+	\returns hash map key for a SysEx template and address (-1 if the template has none)
+*/
+static inline uint64_t midi_ctl_sysex_key(int template, int addr)
+{
+	return (uint64_t) template << 32 | (uint32_t) addr;
+}
+
+/**
+	\returns SysEx controller with given template and address or -1 if there's none
+*/
+static inline int midi_ctl_index_find_sysex(const midi_ctl_index *index, int template, int addr)
+{
+	const int *id = midi_ctl_map_find(&index->sysex, midi_ctl_sysex_key(template, addr));
+	return id ? *id : -1;
+}
+
+/**
+	\returns controller with given channel and address (or plain CC number) or -1 if there's none
+*/
+static inline int midi_ctl_index_find(const midi_ctl_index *index, int channel, int addr)
+{
+	if (channel < 0 || channel >= MIDI_CHANNELS || addr < 0 || addr >= MIDI_ADDRS)
+		return -1;
+	if (addr < MIDI_CCS)
+		return index->cc[channel][addr];
+
+	const int *id = midi_ctl_map_find(&index->params, midi_ctl_key(channel, addr));
+	return id ? *id : -1;
+}
+
+/**
+	\returns "CC", "NRPN" or "RPN" - the kind of the address
+*/
+static inline const char *midi_addr_kind(int addr)
+{
+	return addr < MIDI_ADDR_NRPN ? "CC" : addr < MIDI_ADDR_RPN ? "NRPN" : "RPN";
+}
+
+/**
+	\returns CC or parameter number the address refers to
+*/
+static inline int midi_addr_number(int addr)
+{
+	return addr < MIDI_ADDR_NRPN ? addr : (addr - MIDI_ADDR_NRPN) % MIDI_PARAMS;
+}
+
+/**
+	Number of 64-bit words in a bitset with n bits
+*/
+#define BITSET_WORDS(n) (((n) + 63) / 64)
+
+static inline void bitset_set(uint64_t *set, int i)
+{
+	set[i / 64] |= 1ull << (i % 64);
+}
+
+static inline void bitset_clear(uint64_t *set, int i)
+{
+	set[i / 64] &= ~(1ull << (i % 64));
+}
+
+static inline int bitset_test(const uint64_t *set, int i)
+{
+	return (set[i / 64] >> (i % 64)) & 1;
+}
+
+#endif
@@ -0,0 +1,145 @@
+#include "event_loop.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+// Fixed positions in the pfds array
+#define EVENT_LOOP_FD_STDIN  0
+#define EVENT_LOOP_FD_TIMER  1
+#define EVENT_LOOP_FD_SIGNAL 2
+#define EVENT_LOOP_FD_MIDI_IN 3
+#define EVENT_LOOP_FD_RELOAD 4
+#define EVENT_LOOP_FD_COUNT  5
+
+/**
+	Blocks signals handled through signalfd. Must be called before
+	any threads are started, so they inherit the signal mask.
+*/
+int event_loop_block_signals(void)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGWINCH);
+	return pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0;
+}
+
+/**
+	Creates timer and signal descriptors
+
+	\param midi_in_fd Descriptor signalled when MIDI input is waiting (-1 if none)
+	\param reload_fd Descriptor signalled when the config has been reloaded (-1 if none)
+*/
+int event_loop_init(event_loop *loop, int midi_in_fd, int reload_fd)
+{
+	memset(loop, 0, sizeof(*loop));
+
+	loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop->timer_fd < 0)
+	{
+		perror("timerfd_create() failed");
+		return 1;
+	}
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGWINCH);
+	loop->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (loop->signal_fd < 0)
+	{
+		perror("signalfd() failed");
+		close(loop->timer_fd);
+		return 1;
+	}
+
+	loop->pfds[EVENT_LOOP_FD_STDIN] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
+	loop->pfds[EVENT_LOOP_FD_TIMER] = (struct pollfd){.fd = loop->timer_fd, .events = POLLIN};
+	loop->pfds[EVENT_LOOP_FD_SIGNAL] = (struct pollfd){.fd = loop->signal_fd, .events = POLLIN};
+	loop->pfds[EVENT_LOOP_FD_MIDI_IN] = (struct pollfd){.fd = midi_in_fd, .events = POLLIN};
+	loop->pfds[EVENT_LOOP_FD_RELOAD] = (struct pollfd){.fd = reload_fd, .events = POLLIN};
+	loop->nfds = EVENT_LOOP_FD_COUNT;
+	return 0;
+}
+
+/**
+	Arms the periodic timer (or disarms it if interval is 0)
+*/
+void event_loop_set_timer(event_loop *loop, int interval_ms)
+{
+	if (interval_ms == loop->timer_interval)
+		return;
+
+	struct itimerspec its = {0};
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000l;
+	its.it_value = its.it_interval;
+	timerfd_settime(loop->timer_fd, 0, &its, NULL);
+	loop->timer_interval = interval_ms;
+}
+
+/**
+	Blocks until at least one of the sources is ready or the timeout expires
+
+	\param timeout_ms Maximum time to wait (-1 for no limit)
+	\returns EVENT_LOOP_* bitmask of ready sources, 0 on timeout
+*/
+int event_loop_wait(event_loop *loop, int timeout_ms)
+{
+	int n;
+	do
+		n = poll(loop->pfds, loop->nfds, timeout_ms);
+	while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+	{
+		perror("poll() failed");
+		return 0;
+	}
+
+	int ready = 0;
+
+	if (loop->pfds[EVENT_LOOP_FD_STDIN].revents)
+		ready |= EVENT_LOOP_KEYBOARD;
+
+	if (loop->pfds[EVENT_LOOP_FD_TIMER].revents & POLLIN)
+	{
+		uint64_t expirations;
+		if (read(loop->timer_fd, &expirations, sizeof(expirations)) > 0)
+			ready |= EVENT_LOOP_TIMER;
+	}
+
+	if (loop->pfds[EVENT_LOOP_FD_SIGNAL].revents & POLLIN)
+	{
+		struct signalfd_siginfo si;
+		while (read(loop->signal_fd, &si, sizeof(si)) == sizeof(si))
+			if (si.ssi_signo == SIGWINCH)
+				ready |= EVENT_LOOP_RESIZE;
+	}
+
+	if (loop->pfds[EVENT_LOOP_FD_MIDI_IN].revents & POLLIN)
+	{
+		uint64_t cnt;
+		if (read(loop->pfds[EVENT_LOOP_FD_MIDI_IN].fd, &cnt, sizeof(cnt)) > 0)
+			ready |= EVENT_LOOP_MIDI_IN;
+	}
+
+	if (loop->pfds[EVENT_LOOP_FD_RELOAD].revents & POLLIN)
+	{
+		uint64_t cnt;
+		if (read(loop->pfds[EVENT_LOOP_FD_RELOAD].fd, &cnt, sizeof(cnt)) > 0)
+			ready |= EVENT_LOOP_RELOAD;
+	}
+
+	return ready;
+}
+
+void event_loop_destroy(event_loop *loop)
+{
+	close(loop->timer_fd);
+	close(loop->signal_fd);
+}
@@ -0,0 +1,34 @@
+#ifndef MIDICTL_EVENT_LOOP_H
+#define MIDICTL_EVENT_LOOP_H
+
+#include <poll.h>
+
+/**
+	Event sources reported by event_loop_wait()
+*/
+#define EVENT_LOOP_KEYBOARD (1 << 0)
+#define EVENT_LOOP_MIDI_IN  (1 << 1)
+#define EVENT_LOOP_TIMER    (1 << 2)
+#define EVENT_LOOP_RESIZE   (1 << 3)
+#define EVENT_LOOP_RELOAD   (1 << 4)
+
+/**
+	poll()-based event loop over keyboard, MIDI input thread,
+	config watcher thread, a timer and SIGWINCH
+*/
+typedef struct event_loop
+{
+	struct pollfd pfds[5]; //!< stdin, timer, signal, MIDI input and config reload
+	int nfds;
+	int timer_fd;
+	int signal_fd;
+	int timer_interval; //!< Current timer interval in ms (0 if disarmed)
+} event_loop;
+
+extern int event_loop_block_signals(void);
+extern int event_loop_init(event_loop *loop, int midi_in_fd, int reload_fd);
+extern void event_loop_set_timer(event_loop *loop, int interval_ms);
+extern int event_loop_wait(event_loop *loop, int timeout_ms);
+extern void event_loop_destroy(event_loop *loop);
+
+#endif
@@ -0,0 +1,199 @@
+#include "midi_in.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "utils.h"
+
+/**
+	Maximum number of sequencer descriptors watched
+*/
+#define MIDI_IN_MAX_FDS 8
+
+/**
+	Passes controller change to the UI (input thread only)
+*/
+static int midi_in_push(midi_in *in, const midi_in_event *ev)
+{
+	unsigned int head = in->head;
+	unsigned int tail = __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= MIDI_IN_RING_SIZE)
+	{
+		__atomic_add_fetch(&in->dropped, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	in->buf[head & (MIDI_IN_RING_SIZE - 1)] = *ev;
+	__atomic_store_n(&in->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+	Takes a received controller change (UI thread only)
+
+	\returns 0 on success, non-zero if there's nothing to take
+*/
+int midi_in_pop(midi_in *in, midi_in_event *ev)
+{
+	unsigned int tail = in->tail;
+	unsigned int head = __atomic_load_n(&in->head, __ATOMIC_ACQUIRE);
+	if (tail == head)
+		return 1;
+
+	*ev = in->buf[tail & (MIDI_IN_RING_SIZE - 1)];
+	__atomic_store_n(&in->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+	Handles all events waiting in the sequencer input
+*/
+static void midi_in_receive(midi_in *in)
+{
+	snd_seq_event_t *sev;
+	int received = 0;
+	int forwarded = 0;
+
+	while (alsa_seq_read_input(in->seq, &sev) > 0)
+	{
+		uint64_t stamp = monotonic_ns();
+		int thru_same = 0;
+
+		// Apply the map to a copy and forward it - the UI
+		// gets to see what the device actually sent
+		if (in->out)
+		{
+			midi_out_event oev = {
+				.type = MIDI_OUT_EV_RAW,
+				.stamp = stamp,
+				.raw = *sev,
+			};
+
+			if (midi_thru_apply(in->map, &oev.raw))
+			{
+				// SysEx data lives in the sequencer's input buffer, so it's copied to the sender
+				if (sev->type == SND_SEQ_EVENT_SYSEX)
+				{
+					int len = sev->data.ext.len;
+					uint8_t *data = midi_out_sysex_begin(in->out, MIDI_OUT_PRIO_THRU, len);
+					if (data)
+					{
+						memcpy(data, sev->data.ext.ptr, len);
+						if (!midi_out_sysex_end(in->out, MIDI_OUT_PRIO_THRU, len))
+							forwarded++;
+					}
+				}
+				else if (!midi_out_push(in->out, MIDI_OUT_PRIO_THRU, &oev))
+				{
+					forwarded++;
+					thru_same = !memcmp(&oev.raw.data.control, &sev->data.control, sizeof(sev->data.control));
+				}
+			}
+		}
+
+		if (sev->type != SND_SEQ_EVENT_CONTROLLER)
+			continue;
+
+		int ch = sev->data.control.channel;
+		int cc = sev->data.control.param;
+		if (!INRANGE(ch, 0, 15) || !INRANGE(cc, 0, 127))
+			continue;
+
+		midi_in_event ev = {
+			.channel = ch,
+			.cc = cc,
+			.forwarded = thru_same,
+			.value = sev->data.control.value,
+		};
+
+		if (!midi_in_push(in, &ev))
+			received++;
+	}
+
+	if (forwarded)
+		midi_out_commit(in->out);
+
+	if (received)
+	{
+		uint64_t one = 1;
+		if (write(in->notify_fd, &one, sizeof(one)) < 0)
+			perror("midi_in: write() to eventfd failed");
+	}
+}
+
+/**
+	The input thread
+*/
+static void *midi_in_thread(void *arg)
+{
+	midi_in *in = arg;
+	struct pollfd pfds[MIDI_IN_MAX_FDS + 1];
+	pfds[0] = (struct pollfd){.fd = in->stop_fd, .events = POLLIN};
+	int nfds = 1 + alsa_seq_poll_descriptors(in->seq, pfds + 1, MIDI_IN_MAX_FDS);
+
+	while (1)
+	{
+		if (poll(pfds, nfds, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("midi_in: poll() failed");
+			break;
+		}
+
+		if (pfds[0].revents)
+			break;
+
+		midi_in_receive(in);
+	}
+
+	return NULL;
+}
+
+/**
+	Starts the input thread
+
+	\param out Sender to forward events to or NULL to disable thru
+	\param map Remap/filter table applied to forwarded events
+*/
+int midi_in_init(midi_in *in, midictl_alsa_seq *seq, midi_out *out, const midi_thru_map *map)
+{
+	memset(in, 0, sizeof(*in));
+	in->seq = seq;
+	in->out = out;
+	in->map = map;
+
+	in->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	in->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (in->notify_fd < 0 || in->stop_fd < 0)
+	{
+		perror("eventfd() failed");
+		return 1;
+	}
+
+	int err = pthread_create(&in->thread, NULL, midi_in_thread, in);
+	if (err)
+	{
+		fprintf(stderr, "Failed to start MIDI input thread: %s\n", strerror(err));
+		close(in->notify_fd);
+		close(in->stop_fd);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+	Stops the input thread
+*/
+void midi_in_destroy(midi_in *in)
+{
+	uint64_t one = 1;
+	if (write(in->stop_fd, &one, sizeof(one)) < 0)
+		perror("midi_in: write() to eventfd failed");
+	pthread_join(in->thread, NULL);
+	close(in->notify_fd);
+	close(in->stop_fd);
+}
@@ -0,0 +1,51 @@
+#ifndef MIDICTL_MIDI_IN_H
+#define MIDICTL_MIDI_IN_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "alsa.h"
+#include "midi_out.h"
+#include "midi_thru.h"
+
+/**
+	Feedback ring capacity - must be a power of two
+*/
+#define MIDI_IN_RING_SIZE 4096
+
+/**
+	Controller change received from the device
+*/
+typedef struct midi_in_event
+{
+	uint8_t channel;
+	uint8_t cc;
+	uint8_t forwarded; //!< Forwarded to the output unchanged, so the sender knows the value already
+	int value;
+} midi_in_event;
+
+/**
+	MIDI receiver - owns the input side of the sequencer.
+	Forwards events to the sender (thru) and passes received
+	controller changes to the UI through a lock-free SPSC ring.
+*/
+typedef struct midi_in
+{
+	midictl_alsa_seq *seq;
+	midi_out *out;            //!< Forwarding destination (NULL if thru is disabled)
+	const midi_thru_map *map;
+
+	midi_in_event buf[MIDI_IN_RING_SIZE];
+	unsigned int head;        //!< Written by the input thread
+	unsigned int tail;        //!< Written by the UI thread
+	unsigned int dropped;     //!< Controller changes lost because the UI fell behind
+
+	pthread_t thread;
+	int notify_fd;  //!< eventfd signalled when controller changes are waiting
+	int stop_fd;    //!< eventfd used to stop the input thread
+} midi_in;
+
+extern int midi_in_pop(midi_in *in, midi_in_event *ev);
+extern int midi_in_init(midi_in *in, midictl_alsa_seq *seq, midi_out *out, const midi_thru_map *map);
+extern void midi_in_destroy(midi_in *in);
+
+#endif
@@ -0,0 +1,909 @@
+#include "midi_out.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include "alsa.h"
+#include "utils.h"
+
+/**
+	Size of MIDI CC message in bytes (no running status assumed)
+*/
+#define MIDI_CC_BYTES 3
+
+/**
+	How many bytes can the pacer let through at once
+*/
+#define MIDI_OUT_BURST_BYTES (8 * MIDI_CC_BYTES)
+
+/**
+	Puts an event in one of the rings. Each ring has only one producer -
+	THRU ring is fed by the input thread, the others by the UI thread.
+	The sender thread is not woken up until midi_out_commit() is called.
+
+	\returns 0 on success, non-zero if the ring is full
+*/
+int midi_out_push(midi_out *out, midi_out_prio prio, const midi_out_event *ev)
+{
+	midi_out_ring *r = &out->ring[prio];
+	unsigned int head = r->head;
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= MIDI_OUT_RING_SIZE)
+		return 1;
+
+	r->buf[head & (MIDI_OUT_RING_SIZE - 1)] = *ev;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+	if (prio == MIDI_OUT_PRIO_BULK)
+		out->bulk_total++;
+	return 0;
+}
+
+/**
+	\returns pending output slot of a (N)RPN parameter
+*/
+static inline int *midi_out_param_slot(midi_out *out, int channel, int param)
+{
+	return &out->param_slot[channel * MIDI_OUT_PARAMS + param];
+}
+
+/**
+	\returns last value transmitted for a (N)RPN parameter
+*/
+static inline int *midi_out_param_sent(midi_out *out, int channel, int param)
+{
+	return &out->param_sent[channel * MIDI_OUT_PARAMS + param];
+}
+
+/**
+	Sets pending value in a slot. If an older value has not been sent
+	yet, it's replaced and no new event enters the ring - unless the
+	slot has to be moved ahead of the bulk backlog.
+
+	\param ev Event announcing the slot to the sender
+
+	\returns 0 on success, non-zero if the ring is full
+*/
+static int midi_out_set_slot(midi_out *out, midi_out_prio prio, int *slot, const midi_out_event *ev, int value, int force)
+{
+	int old = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	int new;
+	do
+	{
+		new = value;
+		if (prio == MIDI_OUT_PRIO_HIGH || (old >= 0 && (old & MIDI_OUT_SLOT_HIGH)))
+			new |= MIDI_OUT_SLOT_HIGH;
+		if (force || (old >= 0 && (old & MIDI_OUT_SLOT_FORCE)))
+			new |= MIDI_OUT_SLOT_FORCE;
+	}
+	while (!__atomic_compare_exchange_n(slot, &old, new, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	// Already announced with sufficient priority
+	if (old >= 0 && (prio == MIDI_OUT_PRIO_BULK || (old & MIDI_OUT_SLOT_HIGH)))
+		return 0;
+
+	// Withdraw the value if the sender cannot be notified about it
+	if (midi_out_push(out, prio, ev))
+	{
+		__atomic_compare_exchange_n(slot, &new, old, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+	Sets pending value for MIDI CC. If an older value for the same
+	controller has not been sent yet, it's replaced.
+
+	The sender skips values that the device has already received,
+	unless 'force' is set.
+
+	\returns 0 on success, non-zero if the ring is full
+*/
+int midi_out_set_cc(midi_out *out, midi_out_prio prio, int channel, int cc, int value, int force)
+{
+	midi_out_event ev = {
+		.type = MIDI_OUT_EV_CC,
+		.channel = channel,
+		.cc = cc,
+		.time = 0,
+	};
+
+	return midi_out_set_slot(out, prio, &out->slot[channel][cc], &ev, value, force);
+}
+
+/**
+	Sets pending value for a 14-bit controller. Both halves share the
+	MSB controller's slot, so they always go out together, in one batch,
+	MSB first. The MSB is left out if the device already has it.
+
+	\returns 0 on success, non-zero if the ring is full
+*/
+int midi_out_set_cc14(midi_out *out, midi_out_prio prio, int channel, int cc, int value, int force)
+{
+	return midi_out_set_cc(out, prio, channel, cc, (value & 0x3fff) | MIDI_OUT_SLOT_PAIR, force);
+}
+
+/**
+	Sets pending value for an NRPN or RPN parameter (see MIDI_OUT_PARAM_RPN).
+	The parameter number is sent only if it isn't selected on
+	the channel already, so a sweep takes one data entry message
+	per step (two for 14-bit values, unless the MSB stays the same).
+
+	\param hires Send 14-bit value (data entry MSB and LSB)
+
+	\returns 0 on success, non-zero if the ring is full
+*/
+int midi_out_set_param(midi_out *out, midi_out_prio prio, int channel, int param, int value, int hires, int force)
+{
+	midi_out_event ev = {
+		.type = MIDI_OUT_EV_PARAM,
+		.channel = channel,
+		.param = param,
+		.time = 0,
+	};
+
+	if (hires)
+		value = (value & 0x3fff) | MIDI_OUT_SLOT_PAIR;
+	return midi_out_set_slot(out, prio, midi_out_param_slot(out, channel, param), &ev, value, force);
+}
+
+/**
+	Tells the sender which value the device currently has for a CC
+	(e.g. when it has been received from the device), so the
+	last-transmitted cache stays accurate.
+*/
+int midi_out_note_cc(midi_out *out, int channel, int cc, int value)
+{
+	midi_out_event ev = {
+		.type = MIDI_OUT_EV_CC_STATE,
+		.channel = channel,
+		.cc = cc,
+		.value = value,
+		.time = 0,
+	};
+
+	return midi_out_push(out, MIDI_OUT_PRIO_HIGH, &ev);
+}
+
+/**
+	Reserves room for a SysEx message in one of the rings. The message
+	is built in place and handed over with midi_out_sysex_end().
+	Messages are never split at the end of the data buffer.
+
+	\returns where to put the message or NULL if there's no room for it
+*/
+uint8_t *midi_out_sysex_begin(midi_out *out, midi_out_prio prio, int len)
+{
+	midi_out_ring *r = &out->ring[prio];
+	unsigned int head = r->data_head;
+	unsigned int tail = __atomic_load_n(&r->data_tail, __ATOMIC_ACQUIRE);
+	unsigned int pos = head & (MIDI_OUT_DATA_SIZE - 1);
+	if (pos + len > MIDI_OUT_DATA_SIZE)
+		head += MIDI_OUT_DATA_SIZE - pos;
+
+	if (len > MIDI_OUT_DATA_SIZE || head + len - tail > MIDI_OUT_DATA_SIZE)
+		return NULL;
+
+	r->data_reserved = head;
+	return &r->data[head & (MIDI_OUT_DATA_SIZE - 1)];
+}
+
+/**
+	Puts an event referring to the data reserved with
+	midi_out_sysex_begin() in the ring
+
+	\returns 0 on success, non-zero if the ring is full
+*/
+static int midi_out_push_data(midi_out *out, midi_out_prio prio, midi_out_event *ev, int len)
+{
+	midi_out_ring *r = &out->ring[prio];
+	ev->data = r->data_reserved;
+	if (midi_out_push(out, prio, ev))
+		return 1;
+
+	r->data_head = r->data_reserved + len;
+	return 0;
+}
+
+/**
+	Puts a SysEx message built with midi_out_sysex_begin() in the ring
+
+	\returns 0 on success, non-zero if the ring is full
+*/
+int midi_out_sysex_end(midi_out *out, midi_out_prio prio, int len)
+{
+	midi_out_event ev = {
+		.type = MIDI_OUT_EV_SYSEX,
+		.value = len,
+		.time = 0,
+		.stamp = monotonic_ns(),
+	};
+
+	return midi_out_push_data(out, prio, &ev, len);
+}
+
+/**
+	\returns SysEx controller's slot
+*/
+static inline midi_out_sysex_slot *midi_out_sysex_get(midi_out *out, int id)
+{
+	return &out->sysex[id / MIDI_OUT_SYSEX_CHUNK][id % MIDI_OUT_SYSEX_CHUNK];
+}
+
+/**
+	\returns whether a SysEx slot value (pending or sent) belongs to the generation
+*/
+static inline int midi_out_sysex_gen(int value, int gen)
+{
+	return value >= 0 && value >> MIDI_OUT_SLOT_GEN_SHIFT == gen;
+}
+
+/**
+	Sets pending values for count SysEx controllers at adjacent
+	addresses, starting with id, to be sent in one message. Like with
+	CCs, an unsent value is simply replaced and a new event enters the
+	ring only if some value is not announced with sufficient priority yet.
+
+	The message is built here and the sender puts the latest values in
+	it. Values the device already has are not sent again, unless 'force'
+	is set.
+
+	\returns 0 on success, non-zero if the ring is full
+*/
+int midi_out_set_sysex(midi_out *out, midi_out_prio prio, const sysex_template *t, int addr, int id, const int16_t *values, int count, int force)
+{
+	if (id + count > MIDI_OUT_SYSEX_CHUNKS * MIDI_OUT_SYSEX_CHUNK || count > SYSEX_MERGE_MAX)
+		return 1;
+
+	for (int c = id / MIDI_OUT_SYSEX_CHUNK; c <= (id + count - 1) / MIDI_OUT_SYSEX_CHUNK; c++)
+	{
+		if (out->sysex[c])
+			continue;
+
+		out->sysex[c] = malloc(MIDI_OUT_SYSEX_CHUNK * sizeof(midi_out_sysex_slot));
+		if (!out->sysex[c])
+			return 1;
+		for (int i = 0; i < MIDI_OUT_SYSEX_CHUNK; i++)
+			out->sysex[c][i] = (midi_out_sysex_slot){.value = -1, .sent = -1};
+	}
+
+	int gen = out->sysex_gen;
+	int old[SYSEX_MERGE_MAX], new[SYSEX_MERGE_MAX];
+	int announce = 0;
+	for (int i = 0; i < count; i++)
+	{
+		int *slot = &midi_out_sysex_get(out, id + i)->value;
+		int cur;
+		old[i] = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+		do
+		{
+			cur = midi_out_sysex_gen(old[i], gen) ? old[i] : -1;
+			new[i] = gen << MIDI_OUT_SLOT_GEN_SHIFT | values[i];
+			if (prio == MIDI_OUT_PRIO_HIGH || (cur >= 0 && (cur & MIDI_OUT_SLOT_HIGH)))
+				new[i] |= MIDI_OUT_SLOT_HIGH;
+			if (force || (cur >= 0 && (cur & MIDI_OUT_SLOT_FORCE)))
+				new[i] |= MIDI_OUT_SLOT_FORCE;
+		}
+		while (!__atomic_compare_exchange_n(slot, &old[i], new[i], 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+		if (cur < 0 || (prio == MIDI_OUT_PRIO_HIGH && !(cur & MIDI_OUT_SLOT_HIGH)))
+			announce = 1;
+	}
+
+	if (!announce)
+		return 0;
+
+	sysex_layout layout;
+	sysex_layout_init(&layout, t, count);
+	int len = sizeof(layout) + layout.size;
+	uint8_t *p = midi_out_sysex_begin(out, prio, len);
+	if (p)
+	{
+		memcpy(p, &layout, sizeof(layout));
+		sysex_build(t, p + sizeof(layout), addr, values, count);
+
+		midi_out_event ev = {
+			.type = MIDI_OUT_EV_SYSEX_SLOT,
+			.param = gen,
+			.count = count,
+			.value = id,
+			.time = 0,
+		};
+
+		if (!midi_out_push_data(out, prio, &ev, len))
+			return 0;
+	}
+
+	// Withdraw the values if the sender cannot be notified about them
+	for (int i = 0; i < count; i++)
+		__atomic_compare_exchange_n(&midi_out_sysex_get(out, id + i)->value, &new[i], old[i], 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	return 1;
+}
+
+/**
+	Withdraws the pending value of a SysEx controller (UI thread only)
+
+	\returns non-zero if there was a value waiting to be sent
+*/
+int midi_out_sysex_withdraw(midi_out *out, int id)
+{
+	if (id >= MIDI_OUT_SYSEX_CHUNKS * MIDI_OUT_SYSEX_CHUNK || !out->sysex[id / MIDI_OUT_SYSEX_CHUNK])
+		return 0;
+
+	int *slot = &midi_out_sysex_get(out, id)->value;
+	int value = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	while (midi_out_sysex_gen(value, out->sysex_gen))
+		if (__atomic_compare_exchange_n(slot, &value, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return 1;
+	return 0;
+}
+
+/**
+	Starts a new generation of SysEx slots, when controller IDs get
+	a different meaning (UI thread only). Events and values of older
+	generations are ignored by the sender from now on, so pending
+	values should be withdrawn first.
+*/
+void midi_out_sysex_forget(midi_out *out)
+{
+	out->sysex_gen = (out->sysex_gen + 1) & MIDI_OUT_SLOT_GEN_MASK;
+}
+
+/**
+	Wakes up the sender thread after a batch of events has been pushed
+*/
+void midi_out_commit(midi_out *out)
+{
+	uint64_t one = 1;
+	if (write(out->wake_fd, &one, sizeof(one)) < 0)
+		perror("midi_out: write() to eventfd failed");
+}
+
+/**
+	Reads bulk transmission progress (UI thread only)
+
+	\returns non-zero if bulk transmission is in progress
+*/
+int midi_out_bulk_progress(midi_out *out, unsigned int *done, unsigned int *total)
+{
+	unsigned int d = __atomic_load_n(&out->bulk_done, __ATOMIC_ACQUIRE);
+
+	// All done - the sender will not touch the counter until more is pushed
+	if (d == out->bulk_total)
+	{
+		__atomic_store_n(&out->bulk_done, 0, __ATOMIC_RELEASE);
+		out->bulk_total = 0;
+		d = 0;
+	}
+
+	*done = d;
+	*total = out->bulk_total;
+	return *total != 0;
+}
+
+/**
+	Reads forwarding latency stats (average and maximum time from
+	receiving an event until it has been passed to the sequencer)
+*/
+void midi_out_thru_stats(midi_out *out, uint64_t *count, uint64_t *avg_ns, uint64_t *max_ns)
+{
+	*count = __atomic_load_n(&out->thru_count, __ATOMIC_RELAXED);
+	uint64_t sum = __atomic_load_n(&out->thru_latency_sum, __ATOMIC_RELAXED);
+	*avg_ns = *count ? sum / *count : 0;
+	*max_ns = __atomic_load_n(&out->thru_latency_max, __ATOMIC_RELAXED);
+}
+
+/**
+	Takes an event from the ring (sender thread only)
+
+	\returns 0 on success, non-zero if the ring is empty
+*/
+static int midi_out_pop(midi_out_ring *r, midi_out_event *ev)
+{
+	unsigned int tail = r->tail;
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	if (tail == head)
+		return 1;
+
+	*ev = r->buf[tail & (MIDI_OUT_RING_SIZE - 1)];
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+	Flushes the sequencer output, waiting for room if necessary
+*/
+static void midi_out_flush(midi_out *out)
+{
+	while (alsa_seq_flush(out->seq) == -EAGAIN)
+		alsa_seq_wait_output(out->seq);
+}
+
+/**
+	Waits until the rate limit allows sending provided number of bytes.
+	Everything queued so far is flushed before going to sleep.
+	Messages longer than the burst go out once the bucket is full
+	and the bucket goes into debt.
+*/
+static void midi_out_pace(midi_out *out, int bytes)
+{
+	if (!out->rate)
+		return;
+
+	while (1)
+	{
+		uint64_t now = monotonic_ns();
+		out->tokens += (now - out->tokens_time) * 1e-9 * out->rate;
+		out->tokens = MIN(out->tokens, MIDI_OUT_BURST_BYTES);
+		out->tokens_time = now;
+
+		int need = MIN(bytes, MIDI_OUT_BURST_BYTES);
+		if (out->tokens >= need)
+			break;
+
+		midi_out_flush(out);
+		uint64_t wait = (need - out->tokens) * 1e9 / out->rate + 1;
+		struct timespec ts = {wait / 1000000000ull, wait % 1000000000ull};
+		nanosleep(&ts, NULL);
+	}
+
+	out->tokens -= bytes;
+}
+
+/**
+	Forwarded events never wait for the pacer, but the bytes they
+	take are paid for, so the bulk transmission makes room for them
+*/
+static void midi_out_pace_ring(midi_out *out, const midi_out_ring *r, int bytes)
+{
+	if (r == &out->ring[MIDI_OUT_PRIO_THRU])
+		out->tokens -= bytes;
+	else
+		midi_out_pace(out, bytes);
+}
+
+/**
+	Computes how many bytes sending a pending CC slot value takes.
+	Values the device already has take nothing.
+*/
+static int midi_out_cc_bytes(const midi_out *out, int channel, int cc, int value)
+{
+	int force = value & MIDI_OUT_SLOT_FORCE;
+	int v = value & MIDI_OUT_SLOT_VALUE;
+	if (!(value & MIDI_OUT_SLOT_PAIR))
+		return force || v != out->sent[channel][cc] ? MIDI_CC_BYTES : 0;
+
+	// A new MSB resets the LSB on the device, so both have to be sent then
+	if (force || v >> 7 != out->sent[channel][cc])
+		return 2 * MIDI_CC_BYTES;
+	return (v & 127) != out->sent[channel][cc + 32] ? MIDI_CC_BYTES : 0;
+}
+
+/**
+	Computes how many bytes sending a pending parameter slot value
+	takes - parameter selection (unless already selected) and data entry.
+	After a new selection the data entry MSB is always sent.
+*/
+static int midi_out_param_bytes(midi_out *out, int channel, int param, int value)
+{
+	int force = value & MIDI_OUT_SLOT_FORCE;
+	int v = value & MIDI_OUT_SLOT_VALUE;
+	int sent = *midi_out_param_sent(out, channel, param);
+	if (!force && v == sent)
+		return 0;
+
+	int select = out->selected[channel] != param;
+	int msgs = select ? 2 : 0;
+	if (!(value & MIDI_OUT_SLOT_PAIR))
+		msgs += 1;
+	else if (select || force || sent < 0 || v >> 7 != sent >> 7)
+		msgs += 2;
+	else
+		msgs += 1;
+	return msgs * MIDI_CC_BYTES;
+}
+
+/**
+	\returns pending output slot an event refers to
+*/
+static int *midi_out_event_slot(midi_out *out, const midi_out_event *ev)
+{
+	if (ev->type == MIDI_OUT_EV_PARAM)
+		return midi_out_param_slot(out, ev->channel, ev->param);
+	return &out->slot[ev->channel][ev->cc];
+}
+
+/**
+	\returns number of bytes needed to send pending value of the event's slot
+*/
+static int midi_out_event_bytes(midi_out *out, const midi_out_event *ev, int value)
+{
+	if (ev->type == MIDI_OUT_EV_PARAM)
+		return midi_out_param_bytes(out, ev->channel, ev->param, value);
+	return midi_out_cc_bytes(out, ev->channel, ev->cc, value);
+}
+
+/**
+	Queues a single CC message, waiting for room if necessary
+*/
+static void midi_out_queue_cc(midi_out *out, int channel, int cc, int value)
+{
+	while (alsa_seq_queue_midi_cc(out->seq, channel, cc, value) == -EAGAIN)
+		alsa_seq_wait_output(out->seq);
+	out->sent[channel][cc] = value;
+}
+
+/**
+	Updates the sender's view of the device after a CC has been
+	forwarded or sent on its own. Parameter selection or data entry
+	sent this way makes the cached selection or parameter value unreliable.
+*/
+static void midi_out_note_plain_cc(midi_out *out, int channel, int cc, int value)
+{
+	out->sent[channel][cc] = value;
+	if (INRANGE(cc, 98, 101))
+		out->selected[channel] = -1;
+	else if ((cc == 6 || cc == 38 || cc == 96 || cc == 97) && out->selected[channel] >= 0)
+		*midi_out_param_sent(out, channel, out->selected[channel]) = -1;
+}
+
+/**
+	Queues messages for a pending slot value taken from the event's
+	slot. All of them go in one batch, so nothing can get in between.
+
+	\param bytes What midi_out_event_bytes() returned for the value
+*/
+static void midi_out_queue_slot(midi_out *out, const midi_out_event *ev, int value, int bytes)
+{
+	int ch = ev->channel;
+	int v = value & MIDI_OUT_SLOT_VALUE;
+	int pair = value & MIDI_OUT_SLOT_PAIR;
+
+	if (ev->type == MIDI_OUT_EV_CC)
+	{
+		if (!pair)
+		{
+			midi_out_queue_cc(out, ch, ev->cc, v);
+			midi_out_note_plain_cc(out, ch, ev->cc, v);
+		}
+		else
+		{
+			if (bytes > MIDI_CC_BYTES)
+				midi_out_queue_cc(out, ch, ev->cc, v >> 7);
+			midi_out_queue_cc(out, ch, ev->cc + 32, v & 127);
+		}
+		return;
+	}
+
+	// Select the parameter (NRPN: CC 99/98, RPN: CC 101/100)
+	int rpn = ev->param & MIDI_OUT_PARAM_RPN;
+	int number = ev->param & (MIDI_OUT_PARAM_RPN - 1);
+	if (out->selected[ch] != ev->param)
+	{
+		midi_out_queue_cc(out, ch, rpn ? 101 : 99, number >> 7);
+		midi_out_queue_cc(out, ch, rpn ? 100 : 98, number & 127);
+		out->selected[ch] = ev->param;
+		bytes -= 2 * MIDI_CC_BYTES;
+	}
+	else
+		out->select_skipped++;
+
+	// Data entry MSB (CC 6) and LSB (CC 38)
+	if (!pair)
+		midi_out_queue_cc(out, ch, 6, v);
+	else
+	{
+		if (bytes > MIDI_CC_BYTES)
+			midi_out_queue_cc(out, ch, 6, v >> 7);
+		midi_out_queue_cc(out, ch, 38, v & 127);
+	}
+	*midi_out_param_sent(out, ch, ev->param) = v;
+}
+
+/**
+	Sends pending values of the SysEx slots an event refers to, put in
+	the message prepared by the UI. Slots sent earlier by another event
+	keep the last transmitted value. Nothing is sent if the device has
+	all the values already.
+
+	\returns number of bytes the event takes in the data buffer
+*/
+static int midi_out_send_sysex(midi_out *out, midi_out_ring *r, const midi_out_event *ev)
+{
+	sysex_layout layout;
+	uint8_t *msg = &r->data[ev->data & (MIDI_OUT_DATA_SIZE - 1)];
+	memcpy(&layout, msg, sizeof(layout));
+	msg += sizeof(layout);
+
+	int len = sizeof(layout) + layout.size;
+	int gen = ev->param;
+	int values[SYSEX_MERGE_MAX];
+	int need = 0;
+
+	// The slots may have been sent already by earlier events.
+	// If the device already has all values, drop them without spending pacer's time.
+	while (!need)
+	{
+		int taken = 1;
+		for (int i = 0; i < ev->count; i++)
+		{
+			midi_out_sysex_slot *s = midi_out_sysex_get(out, ev->value + i);
+			values[i] = __atomic_load_n(&s->value, __ATOMIC_ACQUIRE);
+			if (midi_out_sysex_gen(values[i], gen) && ((values[i] & MIDI_OUT_SLOT_FORCE)
+				|| !midi_out_sysex_gen(s->sent, gen) || (values[i] & MIDI_OUT_SLOT_VALUE) != (s->sent & MIDI_OUT_SLOT_VALUE)))
+				need = 1;
+		}
+
+		for (int i = 0; !need && i < ev->count; i++)
+		{
+			if (!midi_out_sysex_gen(values[i], gen))
+				continue;
+			if (__atomic_compare_exchange_n(&midi_out_sysex_get(out, ev->value + i)->value, &values[i], -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				out->sent_skipped++;
+			else
+				taken = 0;
+		}
+
+		if (!need && taken)
+			return len;
+	}
+
+	// Take the values only after pacing, so they're the freshest ones
+	midi_out_pace(out, layout.size);
+	need = 0;
+	for (int i = 0; i < ev->count; i++)
+	{
+		midi_out_sysex_slot *s = midi_out_sysex_get(out, ev->value + i);
+		int value = __atomic_load_n(&s->value, __ATOMIC_ACQUIRE);
+		while (midi_out_sysex_gen(value, gen) && !__atomic_compare_exchange_n(&s->value, &value, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+		if (midi_out_sysex_gen(value, gen))
+		{
+			values[i] = value & MIDI_OUT_SLOT_VALUE;
+			if ((value & MIDI_OUT_SLOT_FORCE) || !midi_out_sysex_gen(s->sent, gen) || values[i] != (s->sent & MIDI_OUT_SLOT_VALUE))
+				need = 1;
+		}
+		else if (midi_out_sysex_gen(s->sent, gen))
+			values[i] = s->sent & MIDI_OUT_SLOT_VALUE;
+		else
+			values[i] = -1; // Keep the value the message was built with
+	}
+
+	if (!need)
+	{
+		out->tokens += layout.size;
+		out->sent_skipped++;
+		return len;
+	}
+
+	sysex_patch(&layout, msg, values, ev->count);
+	while (alsa_seq_queue_sysex(out->seq, msg, layout.size) == -EAGAIN)
+		alsa_seq_wait_output(out->seq);
+
+	for (int i = 0; i < ev->count; i++)
+		midi_out_sysex_get(out, ev->value + i)->sent = values[i] < 0 ? -1 : gen << MIDI_OUT_SLOT_GEN_SHIFT | values[i];
+	return len;
+}
+
+/**
+	Passes a single event to the sequencer. If the output buffer
+	is full (direct mode), waits until there's room for it.
+*/
+static void midi_out_dispatch(midi_out *out, midi_out_ring *r, const midi_out_event *ev)
+{
+	int *slot;
+	int value, bytes;
+	switch (ev->type)
+	{
+		case MIDI_OUT_EV_CC:
+		case MIDI_OUT_EV_PARAM:
+			slot = midi_out_event_slot(out, ev);
+
+			// The slot may have been sent already by an earlier event.
+			// If the device already has this value, drop it without spending pacer's time.
+			value = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+			while (value >= 0 && !midi_out_event_bytes(out, ev, value))
+			{
+				if (__atomic_compare_exchange_n(slot, &value, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				{
+					out->sent_skipped++;
+					value = -1;
+				}
+			}
+
+			if (value < 0)
+				break;
+
+			// Take the value only after pacing, so it's the freshest one
+			bytes = midi_out_event_bytes(out, ev, value);
+			midi_out_pace(out, bytes);
+			value = __atomic_exchange_n(slot, -1, __ATOMIC_ACQ_REL);
+			if (value < 0)
+				break;
+
+			int need = midi_out_event_bytes(out, ev, value);
+			if (!need)
+			{
+				out->sent_skipped++;
+				break;
+			}
+
+			// The pacer may flush, so all messages are paid for before anything is queued
+			if (need > bytes)
+				midi_out_pace(out, need - bytes);
+			else
+				out->tokens += bytes - need;
+
+			midi_out_queue_slot(out, ev, value, need);
+			break;
+
+		case MIDI_OUT_EV_CC_STATE:
+			out->sent[ev->channel][ev->cc] = ev->value;
+			break;
+
+		case MIDI_OUT_EV_RAW:
+			midi_out_pace_ring(out, r, MIDI_CC_BYTES);
+			snd_seq_event_t raw = ev->raw;
+			while (alsa_seq_queue_event(out->seq, &raw) == -EAGAIN)
+				alsa_seq_wait_output(out->seq);
+
+			// Forwarded CC becomes the device's current value
+			if (raw.type == SND_SEQ_EVENT_CONTROLLER)
+				midi_out_note_plain_cc(out, raw.data.control.channel & 15, raw.data.control.param & 127, raw.data.control.value);
+			break;
+
+		case MIDI_OUT_EV_SYSEX:
+			midi_out_pace_ring(out, r, ev->value);
+			while (alsa_seq_queue_sysex(out->seq, &r->data[ev->data & (MIDI_OUT_DATA_SIZE - 1)], ev->value) == -EAGAIN)
+				alsa_seq_wait_output(out->seq);
+
+			// The sequencer has its own copy now
+			__atomic_store_n(&r->data_tail, ev->data + ev->value, __ATOMIC_RELEASE);
+			break;
+
+		case MIDI_OUT_EV_SYSEX_SLOT:
+			bytes = midi_out_send_sysex(out, r, ev);
+			__atomic_store_n(&r->data_tail, ev->data + bytes, __ATOMIC_RELEASE);
+			break;
+	}
+}
+
+/**
+	The sender thread - drains the rings (high priority first) and
+	sends the events to the sequencer, one flush per batch
+*/
+static void *midi_out_thread(void *arg)
+{
+	midi_out *out = arg;
+
+	while (1)
+	{
+		uint64_t cnt;
+		if (read(out->wake_fd, &cnt, sizeof(cnt)) < 0 && errno != EINTR)
+		{
+			perror("midi_out: read() from eventfd failed");
+			break;
+		}
+
+		midi_out_event ev;
+		int sent = 0;
+		while (1)
+		{
+			if (!midi_out_pop(&out->ring[MIDI_OUT_PRIO_THRU], &ev))
+			{
+				// Forwarded events go out right away
+				midi_out_dispatch(out, &out->ring[MIDI_OUT_PRIO_THRU], &ev);
+				midi_out_flush(out);
+				uint64_t latency = monotonic_ns() - ev.stamp;
+				__atomic_store_n(&out->thru_latency_sum, out->thru_latency_sum + latency, __ATOMIC_RELAXED);
+				__atomic_store_n(&out->thru_latency_max, MAX(out->thru_latency_max, latency), __ATOMIC_RELAXED);
+				__atomic_store_n(&out->thru_count, out->thru_count + 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			else if (!midi_out_pop(&out->ring[MIDI_OUT_PRIO_HIGH], &ev))
+			{
+				midi_out_dispatch(out, &out->ring[MIDI_OUT_PRIO_HIGH], &ev);
+			}
+			else if (!midi_out_pop(&out->ring[MIDI_OUT_PRIO_BULK], &ev))
+			{
+				midi_out_dispatch(out, &out->ring[MIDI_OUT_PRIO_BULK], &ev);
+				__atomic_add_fetch(&out->bulk_done, 1, __ATOMIC_RELEASE);
+			}
+			else
+				break;
+
+			sent++;
+		}
+
+		if (sent)
+			midi_out_flush(out);
+
+		// The rings have been drained completely, so it's safe to quit now
+		if (!__atomic_load_n(&out->running, __ATOMIC_ACQUIRE))
+			break;
+	}
+
+	return NULL;
+}
+
+/**
+	Starts the sender thread
+
+	\param rate Output rate limit in bytes per second (0 for no limit)
+*/
+int midi_out_init(midi_out *out, midictl_alsa_seq *seq, int rate)
+{
+	memset(out, 0, sizeof(*out));
+	out->seq = seq;
+	out->running = 1;
+	out->rate = rate;
+	out->tokens = MIDI_OUT_BURST_BYTES;
+	out->tokens_time = monotonic_ns();
+
+	for (int ch = 0; ch < MIDI_OUT_CHANNELS; ch++)
+	{
+		for (int cc = 0; cc < MIDI_OUT_CCS; cc++)
+		{
+			out->slot[ch][cc] = -1;
+			out->sent[ch][cc] = -1;
+		}
+		out->selected[ch] = -1;
+	}
+
+	out->param_slot = malloc(MIDI_OUT_CHANNELS * MIDI_OUT_PARAMS * sizeof(int));
+	out->param_sent = malloc(MIDI_OUT_CHANNELS * MIDI_OUT_PARAMS * sizeof(int));
+	if (!out->param_slot || !out->param_sent)
+	{
+		fprintf(stderr, "Failed to allocate MIDI sender state!\n");
+		free(out->param_slot);
+		free(out->param_sent);
+		return 1;
+	}
+
+	for (int i = 0; i < MIDI_OUT_CHANNELS * MIDI_OUT_PARAMS; i++)
+	{
+		out->param_slot[i] = -1;
+		out->param_sent[i] = -1;
+	}
+
+	out->wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (out->wake_fd < 0)
+	{
+		perror("eventfd() failed");
+		free(out->param_slot);
+		free(out->param_sent);
+		return 1;
+	}
+
+	int err = pthread_create(&out->thread, NULL, midi_out_thread, out);
+	if (err)
+	{
+		fprintf(stderr, "Failed to start MIDI sender thread: %s\n", strerror(err));
+		close(out->wake_fd);
+		free(out->param_slot);
+		free(out->param_sent);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+	Sends all events still in the rings and stops the sender thread
+*/
+void midi_out_destroy(midi_out *out)
+{
+	__atomic_store_n(&out->running, 0, __ATOMIC_RELEASE);
+	midi_out_commit(out);
+	pthread_join(out->thread, NULL);
+	close(out->wake_fd);
+	free(out->param_slot);
+	free(out->param_sent);
+	for (int c = 0; c < MIDI_OUT_SYSEX_CHUNKS; c++)
+		free(out->sysex[c]);
+}
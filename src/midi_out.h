@@ -0,0 +1,203 @@
+#ifndef MIDICTL_MIDI_OUT_H
+#define MIDICTL_MIDI_OUT_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "alsa.h"
+#include "sysex.h"
+
+/**
+	Ring capacity - must be a power of two
+*/
+#define MIDI_OUT_RING_SIZE 1024
+
+/**
+	Size of the SysEx data buffer of each ring - must be a power of two
+*/
+#define MIDI_OUT_DATA_SIZE 16384
+
+/**
+	Number of MIDI channels and controllers per channel
+*/
+#define MIDI_OUT_CHANNELS 16
+#define MIDI_OUT_CCS 128
+
+/**
+	Parameter IDs - NRPN numbers, followed by RPN numbers
+*/
+#define MIDI_OUT_PARAM_RPN 0x4000 //!< Added to RPN numbers
+#define MIDI_OUT_PARAMS (2 * MIDI_OUT_PARAM_RPN)
+
+/**
+	SysEx controller slots are allocated in chunks, as needed
+*/
+#define MIDI_OUT_SYSEX_CHUNK 1024
+#define MIDI_OUT_SYSEX_CHUNKS 4096
+
+/**
+	Default output rate limit - 31250 baud DIN MIDI, 10 bits per byte
+*/
+#define MIDI_OUT_DEFAULT_RATE 3125
+
+/**
+	Flags stored in the pending-output slots along with the value
+*/
+#define MIDI_OUT_SLOT_VALUE 0xffff
+#define MIDI_OUT_SLOT_HIGH  0x10000 //!< Already announced on the high priority ring
+#define MIDI_OUT_SLOT_FORCE 0x20000 //!< Send even if it's the same as the last transmitted value
+#define MIDI_OUT_SLOT_PAIR  0x40000 //!< 14-bit value - MSB goes to the CC, LSB to CC + 32
+#define MIDI_OUT_SLOT_GEN_SHIFT 20  //!< SysEx slots keep the generation above the flags
+#define MIDI_OUT_SLOT_GEN_MASK  0x7ff
+
+/**
+	Output priority. Each priority has its own ring. Forwarded (thru)
+	events go first, then high priority events and then the bulk ones.
+
+	The THRU ring is fed by the MIDI input thread, the others by the UI.
+*/
+typedef enum midi_out_prio
+{
+	MIDI_OUT_PRIO_THRU,
+	MIDI_OUT_PRIO_HIGH,
+	MIDI_OUT_PRIO_BULK,
+	MIDI_OUT_PRIO_COUNT
+} midi_out_prio;
+
+/**
+	Type of an event passed to the sender thread
+*/
+typedef enum midi_out_event_type
+{
+	MIDI_OUT_EV_CC,       //!< Send the pending value from the (channel, cc) slot
+	MIDI_OUT_EV_PARAM,    //!< Send the pending value from the (channel, param) slot as (N)RPN
+	MIDI_OUT_EV_CC_STATE, //!< The device reported its value - update the last-transmitted cache
+	MIDI_OUT_EV_RAW,      //!< Forward a sequencer event as it is
+	MIDI_OUT_EV_SYSEX,    //!< Send a SysEx message from the ring's data buffer
+	MIDI_OUT_EV_SYSEX_SLOT, //!< Send pending values from adjacent SysEx slots in a message from the ring's data buffer
+} midi_out_event_type;
+
+/**
+	An event passed to the sender thread through the ring
+*/
+typedef struct midi_out_event
+{
+	uint8_t type;    //!< midi_out_event_type
+	uint8_t channel;
+	uint8_t cc;
+	uint16_t param;  //!< Parameter ID (MIDI_OUT_EV_PARAM) or slot generation (MIDI_OUT_EV_SYSEX_SLOT)
+	uint16_t count;  //!< Number of slots (MIDI_OUT_EV_SYSEX_SLOT only)
+	int value;       //!< Unused for MIDI_OUT_EV_CC and MIDI_OUT_EV_PARAM - the value is taken from the slot table. Message length for MIDI_OUT_EV_SYSEX. First slot for MIDI_OUT_EV_SYSEX_SLOT.
+	unsigned int data; //!< Position of the message in the ring's data buffer (MIDI_OUT_EV_SYSEX and MIDI_OUT_EV_SYSEX_SLOT only)
+	uint64_t time;   //!< Delivery time (CLOCK_MONOTONIC, ns) - 0 means 'now'. Reserved for timed events.
+	uint64_t stamp;  //!< When the event entered midictl (MIDI_OUT_EV_RAW only, for latency stats)
+	snd_seq_event_t raw; //!< Fixed length event to forward (MIDI_OUT_EV_RAW only)
+} midi_out_event;
+
+/**
+	Pending output and last transmitted value of a SysEx controller.
+	Both carry the generation they belong to (see midi_out_sysex_forget()).
+*/
+typedef struct midi_out_sysex_slot
+{
+	int value; //!< Pending value with MIDI_OUT_SLOT_* flags or -1
+	int sent;  //!< Last transmitted value or -1 if unknown. Owned by the sender thread.
+} midi_out_sysex_slot;
+
+/**
+	Lock-free single-producer/single-consumer ring.
+	Only the UI thread writes 'head' and only the sender thread writes 'tail'.
+	SysEx messages are stored in a byte ring next to it, following the same rules.
+*/
+typedef struct midi_out_ring
+{
+	midi_out_event buf[MIDI_OUT_RING_SIZE];
+	unsigned int head;
+	unsigned int tail;
+
+	uint8_t data[MIDI_OUT_DATA_SIZE];
+	unsigned int data_head;
+	unsigned int data_tail;
+	unsigned int data_reserved; //!< Where the message being built starts (producer only)
+} midi_out_ring;
+
+/**
+	MIDI sender - owns the output side of the sequencer
+*/
+typedef struct midi_out
+{
+	midictl_alsa_seq *seq;
+	midi_out_ring ring[MIDI_OUT_PRIO_COUNT];
+
+	/**
+		Pending output - the latest value not yet sent for each
+		(channel, cc) along with MIDI_OUT_SLOT_* flags or -1 if
+		there's nothing to send. A newer value simply overwrites
+		an unsent one.
+	*/
+	int slot[MIDI_OUT_CHANNELS][MIDI_OUT_CCS];
+
+	/**
+		Last value transmitted for each (channel, cc) or -1 if
+		unknown. Owned by the sender thread.
+	*/
+	int sent[MIDI_OUT_CHANNELS][MIDI_OUT_CCS];
+	unsigned int sent_skipped; //!< Number of redundant sends suppressed
+
+	/**
+		Pending output and last transmitted values for (N)RPN
+		parameters, same as above (MIDI_OUT_CHANNELS x MIDI_OUT_PARAMS)
+	*/
+	int *param_slot;
+	int *param_sent;
+
+	/**
+		Parameter ID currently selected with CC 99/98 (or 101/100)
+		on each channel or -1 if unknown. Owned by the sender thread.
+	*/
+	int selected[MIDI_OUT_CHANNELS];
+	unsigned int select_skipped; //!< Number of parameter selections left out
+
+	/**
+		Slots of SysEx controllers, by controller ID. Chunks are
+		allocated by the UI thread before the first event referring
+		to them is pushed. Values of other generations are ignored.
+	*/
+	midi_out_sysex_slot *sysex[MIDI_OUT_SYSEX_CHUNKS];
+	int sysex_gen; //!< Current generation of SysEx slots (UI thread only)
+
+	// Pacer (token bucket)
+	int rate;            //!< Output rate limit in bytes per second (0 for no limit)
+	double tokens;       //!< Bytes that can be sent right away
+	uint64_t tokens_time;
+
+	// Forwarding latency stats (written by the sender thread)
+	uint64_t thru_count;
+	uint64_t thru_latency_sum; //!< ns
+	uint64_t thru_latency_max; //!< ns
+
+	// Bulk transmission progress
+	unsigned int bulk_total; //!< Written by the UI thread
+	unsigned int bulk_done;  //!< Written by the sender thread
+
+	pthread_t thread;
+	int wake_fd;  //!< eventfd used to wake the sender thread
+	int running;
+} midi_out;
+
+extern int midi_out_push(midi_out *out, midi_out_prio prio, const midi_out_event *ev);
+extern int midi_out_set_cc(midi_out *out, midi_out_prio prio, int channel, int cc, int value, int force);
+extern int midi_out_set_cc14(midi_out *out, midi_out_prio prio, int channel, int cc, int value, int force);
+extern int midi_out_set_param(midi_out *out, midi_out_prio prio, int channel, int param, int value, int hires, int force);
+extern int midi_out_note_cc(midi_out *out, int channel, int cc, int value);
+extern uint8_t *midi_out_sysex_begin(midi_out *out, midi_out_prio prio, int len);
+extern int midi_out_sysex_end(midi_out *out, midi_out_prio prio, int len);
+extern int midi_out_set_sysex(midi_out *out, midi_out_prio prio, const sysex_template *t, int addr, int id, const int16_t *values, int count, int force);
+extern int midi_out_sysex_withdraw(midi_out *out, int id);
+extern void midi_out_sysex_forget(midi_out *out);
+extern void midi_out_commit(midi_out *out);
+extern int midi_out_bulk_progress(midi_out *out, unsigned int *done, unsigned int *total);
+extern void midi_out_thru_stats(midi_out *out, uint64_t *count, uint64_t *avg_ns, uint64_t *max_ns);
+extern int midi_out_init(midi_out *out, midictl_alsa_seq *seq, int rate);
+extern void midi_out_destroy(midi_out *out);
+
+#endif
@@ -0,0 +1,241 @@
+#include "midi_thru.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+/**
+	Sets up identity mapping
+*/
+void midi_thru_map_init(midi_thru_map *map)
+{
+	map->drop_types = 0;
+	for (int ch = 0; ch < 16; ch++)
+	{
+		map->channel[ch] = ch;
+		for (int cc = 0; cc < 128; cc++)
+			map->cc[ch][cc] = cc;
+	}
+}
+
+/**
+	\returns MIDI_THRU_* category for provided name or 0
+*/
+static int midi_thru_type_from_name(const char *name)
+{
+	static const struct {const char *name; int type;} types[] = {
+		{"notes",    MIDI_THRU_NOTE},
+		{"cc",       MIDI_THRU_CC},
+		{"program",  MIDI_THRU_PROGRAM},
+		{"pressure", MIDI_THRU_PRESSURE},
+		{"bend",     MIDI_THRU_BEND},
+		{"other",    MIDI_THRU_OTHER},
+		{"sysex",    MIDI_THRU_SYSEX},
+	};
+
+	for (int i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+		if (!strcmp(name, types[i].name))
+			return types[i].type;
+	return 0;
+}
+
+/**
+	Parses optional "on <chan>" suffix
+	\returns non-zero if the rest of the line is empty or a valid suffix
+*/
+static int midi_thru_parse_chan_suffix(const char *s, int *ch)
+{
+	int n = 0;
+	return !*s || (sscanf(s, "on %d %n", ch, &n) == 1 && !s[n]);
+}
+
+/**
+	Parses single map file line
+	\returns 0 on success, 1 on error
+*/
+static int midi_thru_parse_line(midi_thru_map *map, const char *line, const char **errstr)
+{
+	char word[16];
+	int a, b, ch = -1;
+	int n = 0;
+
+	// chan <src> -> <dst>
+	if (sscanf(line, " chan %d -> %d %n", &a, &b, &n) == 2 && !line[n])
+	{
+		if (!INRANGE(a, 0, 15) || !INRANGE(b, 0, 15))
+		{
+			*errstr = "Invalid MIDI channel!";
+			return 1;
+		}
+
+		map->channel[a] = b;
+		return 0;
+	}
+
+	// cc <src> -> <dst> [on <chan>]
+	n = 0;
+	if (sscanf(line, " cc %d -> %d %n", &a, &b, &n) == 2 && midi_thru_parse_chan_suffix(line + n, &ch))
+	{
+		if (!INRANGE(a, 0, 127) || !INRANGE(b, 0, 127) || (ch >= 0 && !INRANGE(ch, 0, 15)))
+		{
+			*errstr = "Invalid CC or channel number!";
+			return 1;
+		}
+
+		for (int i = 0; i < 16; i++)
+			if (ch < 0 || ch == i)
+				map->cc[i][a] = b;
+		return 0;
+	}
+
+	// drop chan <n>
+	n = 0;
+	if (sscanf(line, " drop chan %d %n", &a, &n) == 1 && !line[n])
+	{
+		if (!INRANGE(a, 0, 15))
+		{
+			*errstr = "Invalid MIDI channel!";
+			return 1;
+		}
+
+		map->channel[a] = -1;
+		return 0;
+	}
+
+	// drop cc <n> [on <chan>]
+	n = 0;
+	if (sscanf(line, " drop cc %d %n", &a, &n) == 1 && midi_thru_parse_chan_suffix(line + n, &ch))
+	{
+		if (!INRANGE(a, 0, 127) || (ch >= 0 && !INRANGE(ch, 0, 15)))
+		{
+			*errstr = "Invalid CC or channel number!";
+			return 1;
+		}
+
+		for (int i = 0; i < 16; i++)
+			if (ch < 0 || ch == i)
+				map->cc[i][a] = -1;
+		return 0;
+	}
+
+	// drop <type>
+	n = 0;
+	if (sscanf(line, " drop %15s %n", word, &n) == 1 && !line[n])
+	{
+		int type = midi_thru_type_from_name(word);
+		if (!type)
+		{
+			*errstr = "Unknown event type!";
+			return 1;
+		}
+
+		map->drop_types |= type;
+		return 0;
+	}
+
+	*errstr = "Bad syntax";
+	return 1;
+}
+
+/**
+	Loads remap/filter rules from a file on top of the current map.
+	Lines have one of the following forms:
+		chan <src> -> <dst>
+		cc <src> -> <dst> [on <chan>]
+		drop chan <n>
+		drop cc <n> [on <chan>]
+		drop notes|cc|program|pressure|bend|other|sysex
+*/
+int midi_thru_map_load(midi_thru_map *map, FILE *f)
+{
+	char *line = NULL;
+	size_t line_buffer_len = 0;
+	int fail = 0;
+	for (int line_number = 1; !fail && getline(&line, &line_buffer_len, f) > 0; line_number++)
+	{
+		char *comment = strchr(line, '#');
+		if (comment)
+			*comment = 0;
+		trim_r_whitespace(line);
+		if (isempty(line))
+			continue;
+
+		const char *errstr = NULL;
+		if (midi_thru_parse_line(map, line, &errstr))
+		{
+			fprintf(stderr, "Failed parsing MIDI map!\nOn line %d: %s\n", line_number, errstr);
+			fail = 1;
+		}
+	}
+
+	free(line);
+	return fail;
+}
+
+/**
+	Applies the map to an event in place
+
+	\returns non-zero if the event should be forwarded, 0 if it's dropped
+*/
+int midi_thru_apply(const midi_thru_map *map, snd_seq_event_t *ev)
+{
+	unsigned char *channel;
+	int type;
+
+	switch (ev->type)
+	{
+		case SND_SEQ_EVENT_NOTEON:
+		case SND_SEQ_EVENT_NOTEOFF:
+		case SND_SEQ_EVENT_KEYPRESS:
+			channel = &ev->data.note.channel;
+			type = MIDI_THRU_NOTE;
+			break;
+
+		case SND_SEQ_EVENT_CONTROLLER:
+			channel = &ev->data.control.channel;
+			type = MIDI_THRU_CC;
+			break;
+
+		case SND_SEQ_EVENT_PGMCHANGE:
+			channel = &ev->data.control.channel;
+			type = MIDI_THRU_PROGRAM;
+			break;
+
+		case SND_SEQ_EVENT_CHANPRESS:
+			channel = &ev->data.control.channel;
+			type = MIDI_THRU_PRESSURE;
+			break;
+
+		case SND_SEQ_EVENT_PITCHBEND:
+			channel = &ev->data.control.channel;
+			type = MIDI_THRU_BEND;
+			break;
+
+		// The data is copied by the caller - it cannot outlive the input buffer
+		case SND_SEQ_EVENT_SYSEX:
+			return !(map->drop_types & MIDI_THRU_SYSEX);
+
+		default:
+			// Don't forward sequencer's system announcements
+			return ev->type < SND_SEQ_EVENT_CLIENT_START && !(map->drop_types & MIDI_THRU_OTHER);
+	}
+
+	if (map->drop_types & type)
+		return 0;
+
+	int src_ch = *channel & 15;
+	int dst_ch = map->channel[src_ch];
+	if (dst_ch < 0)
+		return 0;
+
+	if (type == MIDI_THRU_CC)
+	{
+		int cc = map->cc[src_ch][ev->data.control.param & 127];
+		if (cc < 0)
+			return 0;
+		ev->data.control.param = cc;
+	}
+
+	*channel = dst_ch;
+	return 1;
+}
@@ -0,0 +1,33 @@
+#ifndef MIDICTL_MIDI_THRU_H
+#define MIDICTL_MIDI_THRU_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "alsa.h"
+
+/**
+	Event categories which can be dropped as a whole
+*/
+#define MIDI_THRU_NOTE     (1 << 0)
+#define MIDI_THRU_CC       (1 << 1)
+#define MIDI_THRU_PROGRAM  (1 << 2)
+#define MIDI_THRU_PRESSURE (1 << 3)
+#define MIDI_THRU_BEND     (1 << 4)
+#define MIDI_THRU_OTHER    (1 << 5)
+#define MIDI_THRU_SYSEX    (1 << 6)
+
+/**
+	Compiled remap/filter table. Every lookup is a plain array access.
+*/
+typedef struct midi_thru_map
+{
+	uint8_t drop_types;         //!< MIDI_THRU_* bitmask
+	int8_t channel[16];         //!< Destination channel or -1 to drop
+	int16_t cc[16][128];        //!< Destination CC (per source channel) or -1 to drop
+} midi_thru_map;
+
+extern void midi_thru_map_init(midi_thru_map *map);
+extern int midi_thru_map_load(midi_thru_map *map, FILE *f);
+extern int midi_thru_apply(const midi_thru_map *map, snd_seq_event_t *ev);
+
+#endif
@@ -8,18 +8,36 @@
 #include <argp.h>
 #include <assert.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 #include "args.h"
 #include "config_parser.h"
+#include "config_cache.h"
+#include "config_watch.h"
 #include "alsa.h"
+#include "midi_out.h"
+#include "event_loop.h"
+#include "midi_in.h"
+#include "midi_thru.h"
 #include "utils.h"
 
+/**
+	\returns width of the value label - 14-bit values need more digits
+*/
+static int value_label_width(int max)
+{
+	return max > 999 ? 5 : 3;
+}
+
 /**
 	Draws a lame slider
 */
 void draw_slider(WINDOW *win, int y, int x, int w, int v, int min, int max)
 {
+	int vw = value_label_width(max);
+
 	// There's no space for the value...
-	if (w < 7)
+	if (w < vw + 4)
 	{
 		if (w > 0)
 			mvprintw(y, x, "%*d", w, v);
@@ -27,12 +45,12 @@ void draw_slider(WINDOW *win, int y, int x, int w, int v, int min, int max)
 	else
 	{
 		int lw; // Label width
-		mvprintw(y, x, "%3d [%n", v, &lw);
+		mvprintw(y, x, "%*d [%n", vw, v, &lw);
 
 		int sw = w - lw - 1; // Slider width
 		int blocks = (float)(CLAMP(v, min, max) - min) / (max - min) * sw;
 		mvhline(y, x + lw, 0, blocks);
-		mvprintw(y, x + lw + sw, "]");
+		mvprintw(y, x + lw + blocks, "%*s]", sw - blocks, "");
 	}
 }
 
@@ -41,127 +59,359 @@ void draw_slider(WINDOW *win, int y, int x, int w, int v, int min, int max)
 */
 void draw_value_label(WINDOW *win, int y, int x, int w, int v, int min, int max)
 {
-	mvprintw(y, x, "%3d", v);
+	mvprintw(y, x, "%*d", value_label_width(max), v);
 }
 
 /**
-	The main draw function
+	Column layout of the menu
 */
-void draw_menu(WINDOW *win, menu_entry *menu, int count, int offset, int active, float split_pos, int show_lcol)
+typedef struct menu_layout
 {
 	int win_w, win_h;
-	getmaxyx(win, win_h, win_w);
-	
-	int col[3];   // Column positions
-	int colw[3];  // Column widths
-	int split[2]; // Splitter positions
+	int show_lcol;
+	int col[3];   //!< Column positions
+	int colw[3];  //!< Column widths
+	int split[2]; //!< Splitter positions
+} menu_layout;
+
+/**
+	What is currently drawn in a screen row
+*/
+typedef struct menu_row_state
+{
+	int entry;    //!< Menu entry index or -1 for an empty row
+	int value;
+	int selected;
+	int activity;
+	int collapsed; //!< Collapsed section heading
+} menu_row_state;
+
+/**
+	Keeps track of what's on the screen, so only the rows that
+	have changed are redrawn
+*/
+typedef struct menu_renderer
+{
+	menu_layout layout;
+	float split_pos;
+	menu_row_state *rows;
+	int rows_size;
+	int full;     //!< Full repaint requested
+} menu_renderer;
+
+/**
+	Rows shown in the menu - all entries of the current page
+	or only the controllers matching the search
+*/
+typedef struct menu_view
+{
+	const menu_entry *entries;
+	const int *rows;       //!< Entry shown in each row (NULL if all entries are shown)
+	int size;              //!< Number of rows
+	const int *selectable; //!< Ascending rows which can be selected (NULL if all can)
+	int selectable_count;
+} menu_view;
+
+/**
+	\returns view showing all entries of the current page. Only the
+		controllers can be selected - their entries are taken
+		directly from the store.
+*/
+static inline menu_view menu_view_all(const menu_list *menu)
+{
+	const menu_page *page = &menu->pages[menu->page];
+	return (menu_view){
+		menu->entries, NULL, menu->size,
+		menu->ctls.entry + page->first_ctl, page->ctl_count
+	};
+}
+
+/**
+	\returns entry shown in a row
+*/
+static inline int menu_view_entry(const menu_view *view, int row)
+{
+	return view->rows ? view->rows[row] : row;
+}
+
+/**
+	\returns row showing an entry. For hidden entries, it's the
+		nearest row above (e.g. the heading of a collapsed section).
+*/
+static int menu_view_row(const menu_view *view, int entry)
+{
+	if (!view->rows)
+		return entry;
+
+	int lo = 0, hi = view->size;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		if (view->rows[mid] <= entry)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return MAX(lo - 1, 0);
+}
+
+/**
+	\returns section containing an entry or -1 if it's above the first heading
+*/
+static int menu_section_find(const menu_page *page, int entry)
+{
+	int lo = 0, hi = page->section_count;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		if (page->sections[mid].entry <= entry)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+/**
+	\returns whether an entry is the heading of a collapsed section
+*/
+static int menu_heading_collapsed(const menu_page *page, int entry)
+{
+	int sec = menu_section_find(page, entry);
+	return sec >= 0 && page->sections[sec].entry == entry && bitset_test(page->collapsed, sec);
+}
+
+/**
+	Set when something has been drawn over the bottom row
+*/
+static int bottom_mesg_drawn = 0;
+
+/**
+	Computes column layout
+*/
+void menu_layout_compute(menu_layout *l, int win_w, int win_h, float split_pos, int show_lcol)
+{
+	l->win_w = win_w;
+	l->win_h = win_h;
+	l->show_lcol = show_lcol;
 
 	// Optional left column is fixed width
 	if (show_lcol)
 	{
-		col[0] = 0;
-		colw[0] = 4;
-		split[0] = col[0] + colw[0];
+		l->col[0] = 0;
+		l->colw[0] = 6;
+		l->split[0] = l->col[0] + l->colw[0];
 	}
 	else
 	{
-		col[0] = -1;
-		colw[0] = 0;
-		split[0] = -1;
+		l->col[0] = -1;
+		l->colw[0] = 0;
+		l->split[0] = -1;
 	}
 
 	// Middle column with variable width	
-	col[1] = split[0] + 2;
-	colw[1] = (win_w - colw[0] + 1) * CLAMP(split_pos, 0.1f, 0.9f);
-	split[1] = col[1] + colw[1];
+	l->col[1] = l->split[0] + 2;
+	l->colw[1] = (win_w - l->colw[0] + 1) * CLAMP(split_pos, 0.1f, 0.9f);
+	l->split[1] = l->col[1] + l->colw[1];
 
 	// The right column takes the rest
-	col[2] = split[1] + 1;
-	colw[2] = win_w - col[2];
+	l->col[2] = l->split[1] + 1;
+	l->colw[2] = win_w - l->col[2];
+}
 
-	for (int y = 0; y < win_h; y++)
+/**
+	Draws the value part of a controller row
+*/
+void draw_menu_value(WINDOW *win, const menu_layout *l, int y, const midi_ctl_store *ctls, int id)
+{
+	move(y, l->col[2]);
+	clrtoeol();
+
+	if (ctls->flags[id] & MIDI_CTL_SLIDER)
+		draw_slider(win, y, l->col[2], l->colw[2], ctls->value[id], ctls->min[id], ctls->max[id]);
+	else
+		draw_value_label(win, y, l->col[2], l->colw[2], ctls->value[id], ctls->min[id], ctls->max[id]);
+}
+
+/**
+	Draws a single menu row, including splitters
+*/
+void draw_menu_row(WINDOW *win, const menu_layout *l, int y, const menu_entry *ent, const midi_ctl_store *ctls, int selected, int activity, int collapsed)
+{
+	move(y, 0);
+	clrtoeol();
+
+	// Empty row - only splitters
+	if (ent == NULL)
 	{
-		int i = y + offset;
-		int valid = i < count && i >= 0;
-		menu_entry *ent = &menu[i];
+		if (l->show_lcol)
+			mvaddch(y, l->split[0], ACS_VLINE);
+		mvaddch(y, l->split[1], ACS_VLINE);
+		return;
+	}
 
-		if (!valid) continue;
+	// Invert if selected and draw
+	// background for the left and middle column
+	if (selected)
+	{
+		attron(A_REVERSE);
+		mvprintw(y, l->col[0], "%*s", l->split[1], "");
+	}
 
-		// Invert if selected and draw
-		// background for the left and middle column
-		if (i == active)
+	// Left and middle columns
+	if (ent->type == ENTRY_MIDI_CTL)
+	{
+		if (l->show_lcol)
 		{
-			attron(A_REVERSE);
-			mvprintw(y, col[0], "%*s", split[1], "");
+			int addr = midi_ctl_addr(ctls, ent->ctl);
+			if (addr < 0)
+				mvprintw(y, l->col[0], "sx");
+			else if (addr >= MIDI_ADDR_RPN)
+				mvprintw(y, l->col[0], "r%d", addr - MIDI_ADDR_RPN);
+			else if (addr >= MIDI_ADDR_NRPN)
+				mvprintw(y, l->col[0], "n%d", addr - MIDI_ADDR_NRPN);
+			else
+				mvprintw(y, l->col[0], "%3d", addr);
 		}
 
-		// Left and middle columns
-		if (ent->type == ENTRY_MIDI_CTL)
-		{
-			if (show_lcol)
-				mvprintw(y, col[0], "%3d", ent->midi_ctl.cc);
-
-			mvprintw(y, col[1], "%.*s", colw[1], ent->text);
-			int len = strlen(ent->text);
-			int left = colw[1] - len;
-			if (left > 0)
-				mvprintw(y, col[1] + len, "%*s", left, "");
-		}
+		mvprintw(y, l->col[1], "%.*s", l->colw[1], ent->text);
+		int len = strlen(ent->text);
+		int left = l->colw[1] - len;
+		if (left > 0)
+			mvprintw(y, l->col[1] + len, "%*s", left, "");
+
+		// Incoming activity marker
+		if (activity)
+			mvaddch(y, l->col[1] - 1, '*');
+	}
 
+	attroff(A_REVERSE);
+
+	if (ent->type == ENTRY_MIDI_CTL)
+	{
+		if (l->show_lcol)
+			mvaddch(y, l->split[0], ACS_VLINE);
+		mvaddch(y, l->split[1], ACS_VLINE);
+		draw_menu_value(win, l, y, ctls, ent->ctl);
+	}
+	else if (ent->type == ENTRY_HRULE)
+	{
+		// Only collapsed headings can be selected
+		if (selected)
+			attron(A_REVERSE);
+		mvhline(y, 0, 0, l->win_w);
 		attroff(A_REVERSE);
 
-		if (ent->type == ENTRY_MIDI_CTL)
-		{
-			if (ent->midi_ctl.slider)
-				draw_slider(win, y, col[2], colw[2], ent->midi_ctl.value, ent->midi_ctl.min, ent->midi_ctl.max);
-			else
-				draw_value_label(win, y, col[2], colw[2], ent->midi_ctl.value, ent->midi_ctl.min, ent->midi_ctl.max);
-		}
-		else if (ent->type == ENTRY_HRULE)
+		if (ent->text || collapsed)
 		{
-			mvhline(y, 0, 0, win_w);
-
-			if (ent->text)
+			const char *mark = collapsed ? "[+] " : "";
+			const char *text = ent->text ? ent->text : "";
+			int len = strlen(mark) + strlen(text);
+			int x = l->split[1] - len - 3;
+			
+			if (x > l->split[0] && len + 2 < l->colw[1])
 			{
-				int len = strlen(ent->text);
-				int x = split[1] - len - 3;
-				
-				if (x > split[0] && len + 2 < colw[1])
-				{
-					move(y, x);
-					addch(ACS_RTEE);
-					attron(A_REVERSE);
-					printw("%s", ent->text);
-					attroff(A_REVERSE);
-					addch(ACS_LTEE);
-				}
+				move(y, x);
+				addch(ACS_RTEE);
+				attron(A_REVERSE);
+				printw("%s%s", mark, text);
+				attroff(A_REVERSE);
+				addch(ACS_LTEE);
 			}
 		}
+
+		// Crosses where the rule meets the splitters
+		if (l->show_lcol)
+			mvaddch(y, l->split[0], ACS_PLUS);
+		mvaddch(y, l->split[1], ACS_PLUS);
 	}
+}
 
-	// Draw splits
-	if (show_lcol)
-		mvvline(0, split[0], 0, win_h);
-	mvvline(0, split[1], 0, win_h);
+void menu_renderer_destroy(menu_renderer *r)
+{
+	free(r->rows);
+}
+
+/**
+	The main draw function. Only rows whose contents have changed
+	since the previous call are redrawn. The whole screen is repainted
+	only when the layout changes.
+
+	\param offset First row shown
+	\param active Selected entry
+*/
+void draw_menu(WINDOW *win, menu_renderer *r, const menu_list *menu, const menu_view *view, int offset, int active, float split_pos, int show_lcol, uint64_t now)
+{
+	int win_w, win_h;
+	getmaxyx(win, win_h, win_w);
 
-	// Draw crosses where rules are
+	// Layout change requires full repaint
+	menu_layout *l = &r->layout;
+	if (win_w != l->win_w || win_h != l->win_h || split_pos != r->split_pos || show_lcol != l->show_lcol)
+	{
+		menu_layout_compute(l, win_w, win_h, split_pos, show_lcol);
+		r->split_pos = split_pos;
+		r->full = 1;
+	}
+
+	if (win_h > r->rows_size)
+	{
+		r->rows = realloc(r->rows, win_h * sizeof(r->rows[0]));
+		r->rows_size = win_h;
+		r->full = 1;
+	}
+
+	if (r->full)
+	{
+		erase();
+		for (int y = 0; y < win_h; y++)
+			r->rows[y].entry = -2;
+		r->full = 0;
+	}
+
+	// The bottom row might have been covered by a message
+	if (bottom_mesg_drawn && win_h > 0)
+	{
+		r->rows[win_h - 1].entry = -2;
+		bottom_mesg_drawn = 0;
+	}
+
+	const midi_ctl_store *ctls = &menu->ctls;
 	for (int y = 0; y < win_h; y++)
 	{
-		int i = y + offset;
-		int valid = i < count && i >= 0;
-		menu_entry *ent = &menu[i];
-		
-		if (!valid || ent->type != ENTRY_HRULE) continue;
+		int row = y + offset;
+		int valid = row < view->size && row >= 0;
+		int i = valid ? menu_view_entry(view, row) : -1;
+		const menu_entry *ent = valid ? &menu->entries[i] : NULL;
+
+		menu_row_state st = {
+			.entry = i,
+			.selected = valid && i == active,
+		};
 
-		if (show_lcol)
+		if (valid && ent->type == ENTRY_MIDI_CTL)
 		{
-			move(y, split[0]);
-			addch(ACS_PLUS);
+			uint64_t activity = ctls->activity[ent->ctl];
+			st.value = ctls->value[ent->ctl];
+			st.activity = activity && now - activity < MIDI_CTL_ACTIVITY_NS;
 		}
+		else if (valid)
+			st.collapsed = menu_heading_collapsed(&menu->pages[menu->page], i);
+
+		menu_row_state *old = &r->rows[y];
+		if (!memcmp(old, &st, sizeof(st)))
+			continue;
+
+		// Only the value has changed - redraw just the slider
+		if (old->entry == st.entry && old->selected == st.selected && old->activity == st.activity && old->collapsed == st.collapsed)
+			draw_menu_value(win, l, y, ctls, ent->ctl);
+		else
+			draw_menu_row(win, l, y, ent, ctls, st.selected, st.activity, st.collapsed);
 
-		move(y, split[1]);
-		addch(ACS_PLUS);
+		*old = st;
 	}
+
+	wnoutrefresh(win);
 }
 
 /**
@@ -177,6 +427,7 @@ void draw_bottom_mesg(WINDOW *win, const char *format, ...)
 	// Clear the bottom line
 	move(win_h - 1, 0);
 	clrtoeol();
+	bottom_mesg_drawn = 1;
 
 	// Show the line
 	move(win_h - 1, 0);
@@ -206,174 +457,841 @@ char *draw_bottom_prompt(WINDOW *win, const char *prompt, ...)
 }
 
 /**
-	Shows user a search prompt and searches for an item in menu
+	Maximum length of the search query
+*/
+#define MENU_FILTER_QUERY_SIZE 128
 
-	\note Call with menu=NULL or win=NULL to free last search string
+/**
+	Incremental search state. While it's active, only the controllers
+	whose labels contain the query are shown.
 */
-void menu_search(WINDOW *win, menu_entry *menu, int menu_size, menu_entry_type type, int *index)
+typedef struct menu_filter
 {
-	static char *menu_search_last = NULL;
-	if (menu == NULL || win == NULL)
+	int active;       //!< The menu is narrowed down
+	int editing;      //!< The query is being typed
+	char query[MENU_FILTER_QUERY_SIZE]; //!< Case-folded query
+	int query_len;
+	int *rows;        //!< Matching entries
+	int *scratch;     //!< Space for the next set of matches
+	int count;
+	int capacity;
+	int prev_cursor;  //!< Cursor position before the search started
+} menu_filter;
+
+/**
+	\returns view of the menu with the filter applied
+*/
+menu_view menu_filter_view(const menu_filter *f, const menu_list *menu)
+{
+	if (!f->active)
+		return menu_view_all(menu);
+	return (menu_view){menu->entries, f->rows, f->count, NULL, f->count};
+}
+
+/**
+	Finds the controllers matching a query, using the folded labels.
+	When refining, only the current matches are checked, as a longer
+	query cannot match anything else. The matches are replaced only
+	if anything has been found.
+
+	\returns number of matches
+*/
+static int menu_filter_run(menu_filter *f, const menu_list *menu, const char *query, int refine)
+{
+	int count = refine ? f->count : menu->size;
+	int n = 0;
+	for (int i = 0; i < count; i++)
+	{
+		int e = refine ? f->rows[i] : i;
+		const menu_entry *ent = &menu->entries[e];
+		if (ent->type == ENTRY_MIDI_CTL && ent->folded && strstr(ent->folded, query))
+			f->scratch[n++] = e;
+	}
+
+	if (n)
 	{
-		free(menu_search_last);
+		int *rows = f->rows;
+		f->rows = f->scratch;
+		f->scratch = rows;
+		f->count = n;
+	}
+	return n;
+}
+
+/**
+	Shows all entries again
+
+	\param keep Stay on the selected controller (otherwise go back to where the search started)
+*/
+void menu_filter_clear(menu_filter *f, int *cursor, int keep)
+{
+	if (!f->active)
 		return;
+
+	if (!keep)
+		*cursor = f->prev_cursor;
+	f->active = 0;
+	f->editing = 0;
+}
+
+/**
+	Starts a new search. Until something is typed, all controllers
+	are shown and the cursor stays where it was.
+
+	\returns 0 on success
+*/
+int menu_filter_start(menu_filter *f, const menu_list *menu, int *cursor)
+{
+	menu_filter_clear(f, cursor, 1);
+
+	if (menu->size > f->capacity)
+	{
+		int *rows = realloc(f->rows, menu->size * sizeof(int));
+		if (rows)
+			f->rows = rows;
+		int *scratch = realloc(f->scratch, menu->size * sizeof(int));
+		if (scratch)
+			f->scratch = scratch;
+		if (!rows || !scratch)
+			return 1;
+		f->capacity = menu->size;
 	}
 
-	char *str = draw_bottom_prompt(win, "Search for: ");
-	char *needle = str;
-	int repeat = 0;
-	
-	// Repeat search
-	if (isempty(str) && menu_search_last != NULL)
+	f->query[0] = 0;
+	f->query_len = 0;
+	f->count = 0;
+	menu_filter_run(f, menu, "", 0);
+
+	f->prev_cursor = *cursor;
+	f->active = 1;
+	f->editing = 1;
+	if (menu->entries[*cursor].type != ENTRY_MIDI_CTL)
+		*cursor = f->rows[0];
+	return 0;
+}
+
+/**
+	Handles a key while the query is being typed. Each typed character
+	narrows the current matches down. Characters which would leave
+	nothing to show are refused.
+
+	\returns non-zero if the key has been consumed. Other keys (e.g. arrows)
+		are handled as usual.
+*/
+int menu_filter_key(menu_filter *f, const menu_list *menu, int *cursor, int c)
+{
+	switch (c)
 	{
-		needle = menu_search_last;
-		repeat = 1;
+		// Done - an empty query shows everything
+		case KEY_ENTER:
+		case '\n':
+		case '\r':
+			f->editing = 0;
+			if (!f->query_len)
+				menu_filter_clear(f, cursor, 1);
+			return 1;
+
+		// Cancel
+		case 27:
+			menu_filter_clear(f, cursor, 0);
+			return 1;
+
+		// Shorter query can match more, so everything needs to be checked again
+		case KEY_BACKSPACE:
+		case 127:
+		case '\b':
+			if (f->query_len)
+			{
+				f->query[--f->query_len] = 0;
+				menu_filter_run(f, menu, f->query, 0);
+				*cursor = f->rows[0];
+			}
+			return 1;
 	}
 
-	for (int i = 0; i < menu_size; i++)
+	if (c < 0 || c > 127 || !isprint(c))
+		return 0;
+
+	if (f->query_len + 1 < MENU_FILTER_QUERY_SIZE)
 	{
-		int k = (i + 1 + *index) % menu_size;
-		if (menu[k].type == type && menu[k].text && strcasestr(menu[k].text, needle) != NULL)
+		char query[MENU_FILTER_QUERY_SIZE];
+		memcpy(query, f->query, f->query_len);
+		query[f->query_len] = tolower(c);
+		query[f->query_len + 1] = 0;
+
+		if (menu_filter_run(f, menu, query, 1))
 		{
-			*index = k;
-			break;
+			memcpy(f->query, query, f->query_len + 2);
+			f->query_len++;
+			*cursor = f->rows[0];
+			return 1;
 		}
 	}
 
-	if (repeat)
+	beep();
+	return 1;
+}
+
+void menu_filter_destroy(menu_filter *f)
+{
+	free(f->rows);
+	free(f->scratch);
+}
+
+/**
+	Rows of the current page with the contents of collapsed sections
+	left out. Only rebuilt when sections are collapsed or expanded.
+*/
+typedef struct menu_outline
+{
+	int *rows;        //!< Entry shown in each row
+	int *selectable;  //!< Rows with controllers and collapsed headings
+	int size;
+	int selectable_count;
+	int capacity;
+	int valid;        //!< Cleared when the rows need to be rebuilt
+} menu_outline;
+
+/**
+	Adds a range of entries to the outline
+
+	\param first_ctl, end_ctl Controllers in the range
+*/
+static void menu_outline_add(menu_outline *o, const menu_list *menu, int first, int end, int first_ctl, int end_ctl)
+{
+	int base = o->size - first;
+	for (int i = first; i < end; i++)
+		o->rows[o->size++] = i;
+	for (int id = first_ctl; id < end_ctl; id++)
+		o->selectable[o->selectable_count++] = base + menu->ctls.entry[id];
+}
+
+/**
+	Builds the outline of the current page. Collapsed sections are
+	skipped as a whole, so it takes time proportional to the number of
+	shown rows and sections.
+
+	\returns 0 on success
+*/
+static int menu_outline_build(menu_outline *o, const menu_list *menu)
+{
+	if (menu->size > o->capacity)
+	{
+		int *rows = realloc(o->rows, menu->size * sizeof(int));
+		if (rows)
+			o->rows = rows;
+		int *selectable = realloc(o->selectable, menu->size * sizeof(int));
+		if (selectable)
+			o->selectable = selectable;
+		if (!rows || !selectable)
+			return 1;
+		o->capacity = menu->size;
+	}
+
+	const menu_page *page = &menu->pages[menu->page];
+	int ctl_end = page->first_ctl + page->ctl_count;
+	o->size = 0;
+	o->selectable_count = 0;
+
+	// Everything above the first heading is always shown
+	if (page->section_count)
+		menu_outline_add(o, menu, 0, page->sections[0].entry, page->first_ctl, page->sections[0].first_ctl);
+	else
+		menu_outline_add(o, menu, 0, menu->size, page->first_ctl, ctl_end);
+
+	for (int i = 0; i < page->section_count; i++)
+	{
+		const menu_section *sec = &page->sections[i];
+		if (bitset_test(page->collapsed, i))
+		{
+			o->selectable[o->selectable_count++] = o->size;
+			o->rows[o->size++] = sec->entry;
+			continue;
+		}
+
+		int last = i + 1 == page->section_count;
+		menu_outline_add(o, menu, sec->entry, last ? menu->size : sec[1].entry, sec->first_ctl, last ? ctl_end : sec[1].first_ctl);
+	}
+
+	o->valid = 1;
+	return 0;
+}
+
+/**
+	\returns view of the current page with collapsed sections left out
+*/
+menu_view menu_outline_view(menu_outline *o, const menu_list *menu)
+{
+	if (!menu->pages[menu->page].collapsed_count || (!o->valid && menu_outline_build(o, menu)))
+		return menu_view_all(menu);
+	return (menu_view){menu->entries, o->rows, o->size, o->selectable, o->selectable_count};
+}
+
+/**
+	\returns the first controller of a section or its heading if it has none
+*/
+static int menu_section_first_row(const menu_list *menu, const menu_page *page, int sec)
+{
+	int next = sec + 1 < page->section_count ? page->sections[sec + 1].first_ctl : page->first_ctl + page->ctl_count;
+	int id = page->sections[sec].first_ctl;
+	return id < next ? menu->ctls.entry[id] : page->sections[sec].entry;
+}
+
+/**
+	Collapses the section containing the cursor or expands it,
+	if it's collapsed already. Collapsing moves the cursor to the heading.
+*/
+void menu_toggle_section(menu_list *menu, menu_outline *o, int *cursor)
+{
+	menu_page *page = &menu->pages[menu->page];
+	int sec = menu_section_find(page, *cursor);
+	if (sec < 0)
+		return;
+
+	if (bitset_test(page->collapsed, sec))
+	{
+		bitset_clear(page->collapsed, sec);
+		page->collapsed_count--;
+		*cursor = menu_section_first_row(menu, page, sec);
+	}
+	else
+	{
+		bitset_set(page->collapsed, sec);
+		page->collapsed_count++;
+		*cursor = page->sections[sec].entry;
+	}
+	o->valid = 0;
+}
+
+/**
+	Collapses all sections of the page or expands them if they're all collapsed
+*/
+void menu_toggle_all_sections(menu_list *menu, menu_outline *o, int *cursor)
+{
+	menu_page *page = &menu->pages[menu->page];
+	int collapse = page->collapsed_count < page->section_count;
+	for (int i = 0; i < page->section_count; i++)
+		if (collapse)
+			bitset_set(page->collapsed, i);
+		else
+			bitset_clear(page->collapsed, i);
+	page->collapsed_count = collapse ? page->section_count : 0;
+
+	int sec = menu_section_find(page, *cursor);
+	if (sec >= 0)
+		*cursor = collapse ? page->sections[sec].entry : menu_section_first_row(menu, page, sec);
+	o->valid = 0;
+}
+
+/**
+	Expands the section containing the cursor, if the cursor
+	has been moved into a collapsed one (e.g. by search)
+*/
+void menu_reveal_cursor(menu_list *menu, menu_outline *o, int cursor)
+{
+	menu_page *page = &menu->pages[menu->page];
+	int sec = menu_section_find(page, cursor);
+	if (sec < 0 || page->sections[sec].entry == cursor || !bitset_test(page->collapsed, sec))
+		return;
+
+	bitset_clear(page->collapsed, sec);
+	page->collapsed_count--;
+	o->valid = 0;
+}
+
+void menu_outline_destroy(menu_outline *o)
+{
+	free(o->rows);
+	free(o->selectable);
+}
+
+/**
+	\returns index of the first selectable row at or after the given row
+		(number of selectable rows if there's none)
+*/
+static int menu_view_lower_bound(const menu_view *view, int row)
+{
+	if (!view->selectable)
+		return CLAMP(row, 0, view->selectable_count);
+
+	int lo = 0, hi = view->selectable_count;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		if (view->selectable[mid] < row)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+	Moves menu cursor (an entry) by delta rows, to the nearest selectable
+	row in the direction of movement. Past the end of the list, the last
+	selectable row is chosen. Takes logarithmic time regardless of the distance.
+*/
+void menu_move_cursor(const menu_view *view, int *cursor, int delta)
+{
+	int n = view->selectable_count;
+	if (!n)
+		return;
+
+	int target = menu_view_row(view, *cursor) + delta;
+	int k = menu_view_lower_bound(view, target);
+	if (delta > 0)
+		k = MIN(k, n - 1);
+	else
+	{
+		if (k == n || (view->selectable ? view->selectable[k] : k) != target)
+			k--;
+		k = MAX(k, 0);
+	}
+
+	*cursor = menu_view_entry(view, view->selectable ? view->selectable[k] : k);
+}
+
+/**
+	Scrolls the viewport so the cursor is visible. The list is not
+	scrolled past its end, so it's filled up when it gets shorter.
+
+	\returns new viewport offset
+*/
+int menu_viewport_follow(int offset, int cursor, int rows, int height)
+{
+	if (cursor < offset)
+		offset = cursor;
+	if (cursor - offset >= height)
+		offset = cursor - height + 1;
+	return CLAMP(offset, 0, MAX(rows - height, 0));
+}
+
+/**
+	Sets a value for MIDI controller.
+	The controller is marked as changed only if the value actually moves.
+*/
+void midi_ctl_set(midi_ctl_store *ctls, int id, int v)
+{
+	assert(INRANGE(id, 0, ctls->count - 1));
+	v = CLAMP(v, ctls->min[id], ctls->max[id]);
+	if (v == ctls->value[id])
+		return;
+
+	ctls->value[id] = v;
+	bitset_set(ctls->changed, id);
+}
+
+/**
+	\returns the big step for a controller - one MSB step for 14-bit controllers
+*/
+static inline int midi_ctl_coarse_step(const midi_ctl_store *ctls, int id)
+{
+	return ctls->flags[id] & MIDI_CTL_HIRES ? 128 : 10;
+}
+
+/**
+	Pass MIDI CC based on current state of provided controller
+	to the sender's pending output. If an older value is still waiting
+	there, it's overwritten. The sender is not woken up until midi_out_commit() is called.
+
+	\returns 0 on success, non-zero if the sender's ring is full (the controller stays marked as changed)
+*/
+int midi_ctl_send_cc(midi_ctl_store *ctls, int id, midi_out *out, midi_out_prio prio, int default_midi_channel)
+{
+	int ch = midi_ctl_channel(ctls, id, default_midi_channel);
+	int force = bitset_test(ctls->force, id);
+	int hires = ctls->flags[id] & MIDI_CTL_HIRES;
+	int err;
+	if (ctls->flags[id] & MIDI_CTL_NRPN)
+		err = midi_out_set_param(out, prio, ch, ctls->cc[id], ctls->value[id], hires, force);
+	else if (ctls->flags[id] & MIDI_CTL_RPN)
+		err = midi_out_set_param(out, prio, ch, MIDI_OUT_PARAM_RPN + ctls->cc[id], ctls->value[id], hires, force);
+	else if (hires)
+		err = midi_out_set_cc14(out, prio, ch, ctls->cc[id], ctls->value[id], force);
+	else
+		err = midi_out_set_cc(out, prio, ch, ctls->cc[id], ctls->value[id], force);
+	if (!err)
 	{
-		free(str);
+		bitset_clear(ctls->changed, id);
+		bitset_clear(ctls->force, id);
 	}
+	return err;
+}
+
+/**
+	Pass values of count SysEx controllers at adjacent addresses,
+	starting with id, to the sender, to be sent in one message.
+
+	\returns 0 on success, non-zero if the sender's ring is full
+*/
+static int midi_ctl_send_sysex(menu_list *menu, int id, int count, midi_out *out, midi_out_prio prio)
+{
+	midi_ctl_store *ctls = &menu->ctls;
+	const sysex_template *t = &menu->sysex[ctls->cc[id]];
+	int force = 0;
+	for (int i = id; i < id + count; i++)
+		force |= bitset_test(ctls->force, i);
+
+	if (midi_out_set_sysex(out, prio, t, ctls->sysex_addr[id], id, &ctls->value[id], count, force))
+		return 1;
+
+	for (int i = id; i < id + count; i++)
+	{
+		bitset_clear(ctls->changed, i);
+		bitset_clear(ctls->force, i);
+	}
+	return 0;
+}
+
+/**
+	\returns number of changed SysEx controllers following id which can be
+		sent in one message with it
+*/
+static int midi_ctl_sysex_run(const menu_list *menu, int id)
+{
+	const midi_ctl_store *ctls = &menu->ctls;
+	const sysex_template *t = &menu->sysex[ctls->cc[id]];
+	if (!sysex_template_mergeable(t))
+		return 1;
+
+	int n = 1;
+	while (id + n < ctls->count && (n + 1) * t->value_len <= SYSEX_MERGE_MAX
+		&& bitset_test(ctls->changed, id + n)
+		&& (ctls->flags[id + n] & MIDI_CTL_SYSEX)
+		&& ctls->cc[id + n] == ctls->cc[id]
+		&& ctls->sysex_addr[id + n] == sysex_addr_offset(t, ctls->sysex_addr[id], n))
+		n++;
+	return n;
+}
+
+/**
+	Resets the value to default
+*/
+void midi_ctl_reset(midi_ctl_store *ctls, int id)
+{
+	if (ctls->def[id] < 0)
+		midi_ctl_set(ctls, id, (ctls->min[id] + ctls->max[id]) / 2);
 	else
+		midi_ctl_set(ctls, id, ctls->def[id]);
+}
+
+/**
+	Mark MIDI controller for retransmission, even if the value
+	has been sent already
+*/
+void midi_ctl_touch(midi_ctl_store *ctls, int id)
+{
+	bitset_set(ctls->changed, id);
+	bitset_set(ctls->force, id);
+}
+
+/**
+	Reset all controllers
+*/
+void midi_ctl_reset_all(midi_ctl_store *ctls)
+{
+	for (int i = 0; i < ctls->count; i++)
+		midi_ctl_reset(ctls, i);
+}
+
+/**
+	Mark all controllers for retransmission
+*/
+void midi_ctl_touch_all(midi_ctl_store *ctls)
+{
+	int words = BITSET_WORDS(ctls->count);
+	for (int w = 0; w < words; w++)
 	{
-		free(menu_search_last);
-		menu_search_last = str;
+		uint64_t bits = w == words - 1 && ctls->count % 64 ? (1ull << (ctls->count % 64)) - 1 : ~0ull;
+		ctls->changed[w] = bits;
+		ctls->force[w] = bits;
 	}
 }
 
 /**
-	Moves menu
+	Update (transmit) all controllers marked as changed.
+	All events are handed to the sender thread as one batch and this
+	function returns immediately. The active controller is sent with
+	high priority, so it's not held back by the paced bulk transmission.
+
+	Changed SysEx controllers at adjacent addresses are merged into
+	one message, if their template allows it.
+
+	\param active ID of the selected controller (-1 if none)
+	\returns number of controllers which could not be sent because the
+		sender's ring is full. They remain marked as changed and are
+		retried on the next update.
 */
-void menu_move_cursor(menu_entry *menu, int entry_count, int *cursor, int delta)
+int midi_ctl_update_changed(menu_list *menu, int active, midi_out *out, int default_midi_channel)
 {
-	int c = *cursor + delta;
-	int d = delta > 0 ? 1 : -1;
+	midi_ctl_store *ctls = &menu->ctls;
+	int sent = 0;
+	int pending = 0;
+	int full = 0;
 
-	// If not on valid field, continue moving
-	while (c >= 0 && c < entry_count && menu[c].type != ENTRY_MIDI_CTL)
-		c += d;
+	if (active >= 0 && bitset_test(ctls->changed, active))
+	{
+		int err;
+		if (ctls->flags[active] & MIDI_CTL_SYSEX)
+			err = midi_ctl_send_sysex(menu, active, 1, out, MIDI_OUT_PRIO_HIGH);
+		else
+			err = midi_ctl_send_cc(ctls, active, out, MIDI_OUT_PRIO_HIGH, default_midi_channel);
+
+		if (err)
+			full = 1;
+		else
+			sent++;
+	}
 
-	// If reached end of the list, search from the end in the opposite direction
-	if (c < 0 || c >= entry_count)
+	// Only the words with any bits set need to be looked at
+	int words = BITSET_WORDS(ctls->count);
+	for (int w = 0; w < words; w++)
 	{
-		c = d > 0 ? entry_count - 1 : 0;
-		while (c >= 0 && c < entry_count && menu[c].type != ENTRY_MIDI_CTL)
-			c -= d;
+		uint64_t bits = ctls->changed[w];
+		if (full)
+		{
+			pending += __builtin_popcountll(bits);
+			continue;
+		}
+
+		while (bits)
+		{
+			int i = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+
+			if (full)
+			{
+				pending++;
+				continue;
+			}
+
+			if (ctls->flags[i] & MIDI_CTL_SYSEX)
+			{
+				int n = midi_ctl_sysex_run(menu, i);
+				if (midi_ctl_send_sysex(menu, i, n, out, MIDI_OUT_PRIO_BULK))
+				{
+					full = 1;
+					pending++;
+					continue;
+				}
+
+				// Merged controllers may reach into the following words
+				sent += n;
+				w = (i + n - 1) / 64;
+				bits = ctls->changed[w] & ~((2ull << ((i + n - 1) % 64)) - 1);
+			}
+			else if (midi_ctl_send_cc(ctls, i, out, MIDI_OUT_PRIO_BULK, default_midi_channel))
+			{
+				full = 1;
+				pending++;
+			}
+			else
+				sent++;
+		}
 	}
 
-	// If reached the end again, do not update
-	if (c >= 0 && c < entry_count)
-		*cursor = c;
+	if (sent)
+		midi_out_commit(out);
+
+	return pending;
 }
 
 /**
-	Sets a value for MIDI controller menu entry
+	Updates controller with a value received from the device on given CC.
+	The value is not sent back - a change still waiting to be sent is
+	dropped. For 14-bit controllers, a new MSB clears the LSB, as the
+	receiving end is supposed to do.
 */
-void midi_ctl_set(menu_entry *ent, int v)
+void midi_ctl_feedback(midi_ctl_store *ctls, int id, int cc, int value, uint64_t now)
 {
-	assert(ent->type == ENTRY_MIDI_CTL);
-	ent->midi_ctl.value = CLAMP(v, ent->midi_ctl.min, ent->midi_ctl.max);
-	ent->midi_ctl.changed = 1;
+	if (ctls->flags[id] & MIDI_CTL_HIRES)
+		value = cc == ctls->cc[id] ? value << 7 : (ctls->value[id] & ~127) | value;
+
+	ctls->value[id] = CLAMP(value, ctls->min[id], ctls->max[id]);
+	ctls->activity[id] = now;
+	bitset_clear(ctls->changed, id);
+	bitset_clear(ctls->force, id);
 }
 
 /**
-	Send MIDI CC based on current state of provided MIDI_CTL menu entry
+	\returns whether any of the visible controllers shows an activity marker
 */
-void midi_ctl_send_cc(menu_entry *ent, midictl_alsa_seq *seq, int default_midi_channel)
+int midi_ctl_activity_visible(const menu_list *menu, const menu_view *view, int offset, int rows, uint64_t now)
 {
-	assert(ent->type == ENTRY_MIDI_CTL);
-	int ch = ent->midi_ctl.channel < 0 ? default_midi_channel : ent->midi_ctl.channel;
-	alsa_seq_send_midi_cc(seq, ch, ent->midi_ctl.cc, ent->midi_ctl.value);
-	ent->midi_ctl.changed = 0;
+	for (int row = MAX(offset, 0); row < MIN(offset + rows, view->size); row++)
+	{
+		const menu_entry *ent = &menu->entries[menu_view_entry(view, row)];
+		if (ent->type != ENTRY_MIDI_CTL)
+			continue;
+
+		uint64_t activity = menu->ctls.activity[ent->ctl];
+		if (activity && now - activity < MIDI_CTL_ACTIVITY_NS)
+			return 1;
+	}
+	return 0;
 }
 
 /**
-	Resets the value to default
+	MIDI learn state
 */
-void midi_ctl_reset(menu_entry *ent)
+typedef struct midi_learn_state
 {
-	assert(ent->type == ENTRY_MIDI_CTL);
-	if (ent->midi_ctl.def < 0)
-		midi_ctl_set(ent, (ent->midi_ctl.min + ent->midi_ctl.max) / 2);
-	else
-		midi_ctl_set(ent, ent->midi_ctl.def);
-}
+	int ctl;                  //!< Controller waiting for an incoming controller (-1 if not learning)
+	const char *config_path;
+} midi_learn_state;
 
 /**
-	Mark MIDI controller as changed
+	Size of the status message shown on the bottom line
 */
-void midi_ctl_touch(menu_entry *ent)
-{
-	assert(ent->type == ENTRY_MIDI_CTL);
-	ent->midi_ctl.changed = 1;
-}
+#define STATUS_SIZE 256
 
 /**
-	Reset all controllers in menu
+	Binds controller to a controller received from the device
+	and writes the change back to the config file
 */
-void midi_ctl_reset_all(menu_entry *menu, int menu_size)
+void midi_ctl_learn(midi_learn_state *learn, menu_list *menu, int channel, int cc, char *status)
 {
-	for (int i = 0; i < menu_size; i++)
-		if (menu[i].type == ENTRY_MIDI_CTL)
-			midi_ctl_reset(&menu[i]);
+	midi_ctl_store *ctls = &menu->ctls;
+	int i = learn->ctl;
+	learn->ctl = -1;
+
+	if (ctls->flags[i] & (MIDI_CTL_NRPN | MIDI_CTL_RPN | MIDI_CTL_SYSEX))
+	{
+		snprintf(status, STATUS_SIZE, "NRPN, RPN and SysEx controllers cannot be bound to a CC");
+		return;
+	}
+
+	// 14-bit controllers are bound by their MSB, no matter which half arrives first
+	if ((ctls->flags[i] & MIDI_CTL_HIRES) && INRANGE(cc, MIDI_CTL_LSB_OFFSET, 2 * MIDI_CTL_LSB_OFFSET - 1))
+		cc -= MIDI_CTL_LSB_OFFSET;
+
+	if (cc > midi_ctl_max_cc(ctls, i))
+	{
+		snprintf(status, STATUS_SIZE, "14-bit controllers can only be bound to CC 0-%d", MIDI_CTL_LSB_OFFSET - 1);
+		return;
+	}
+
+	// Update the lookup table, unless the CC (or the LSB CC) is taken
+	int old_cc = ctls->cc[i];
+	int old_channel = ctls->channel[i];
+	midi_ctl_index_remove(&menu->index, ctls, i, menu->default_channel);
+	ctls->cc[i] = cc;
+	if (channel != menu->default_channel || ctls->channel[i] >= 0)
+		ctls->channel[i] = channel;
+
+	int owner = midi_ctl_index_insert(&menu->index, ctls, i, menu->default_channel);
+	if (owner >= 0)
+	{
+		ctls->cc[i] = old_cc;
+		ctls->channel[i] = old_channel;
+		midi_ctl_index_insert(&menu->index, ctls, i, menu->default_channel);
+		snprintf(status, STATUS_SIZE, "CC %d on channel %d is already assigned to '%s'", cc, channel, menu_ctl_entry(menu, owner)->text);
+		return;
+	}
+
+	// Controllers from included files are written back there
+	const menu_entry *ent = menu_ctl_entry(menu, i);
+	if (config_rebind_ctl(ent->file ? ent->file : learn->config_path, ent->line, ctls->cc[i], ctls->channel[i]))
+		snprintf(status, STATUS_SIZE, "Bound to CC %d on channel %d, but the config file could not be updated!", cc, channel);
+	else
+		snprintf(status, STATUS_SIZE, "Bound to CC %d on channel %d", cc, channel);
 }
 
 /**
-	Mark all controllers in menu as changed
+	Maximum number of incoming events handled in one go, so
+	a dense stream cannot starve the keyboard
 */
-void midi_ctl_touch_all(menu_entry *menu, int menu_size)
-{
-	for (int i = 0; i < menu_size; i++)
-		if (menu[i].type == ENTRY_MIDI_CTL)
-			midi_ctl_touch(&menu[i]);
-}
+#define MIDI_IN_BATCH 4096
 
 /**
-	Update (transmit) all controllers marked as changed
+	Handles controller changes received by the input thread
+
+	\returns number of controllers updated
 */
-void midi_ctl_update_changed(menu_entry *menu, int menu_size, midictl_alsa_seq *seq, int default_midi_channel)
+int midi_in_handle(midi_in *in, menu_list *menu, midi_out *out, midi_learn_state *learn, char *status)
 {
-	for (int i = 0; i < menu_size; i++)
-		if (menu[i].type == ENTRY_MIDI_CTL && menu[i].midi_ctl.changed)
-			midi_ctl_send_cc(&menu[i], seq, default_midi_channel);
+	uint64_t now = monotonic_ns();
+	midi_in_event ev;
+	int updated = 0;
+	int noted = 0;
+
+	for (int n = 0; n < MIDI_IN_BATCH && !midi_in_pop(in, &ev); n++)
+	{
+		int ch = ev.channel;
+		int cc = ev.cc;
+		int value = ev.value;
+
+		// The first controller that arrives is the one being learned
+		if (learn->ctl >= 0)
+		{
+			midi_ctl_learn(learn, menu, ch, cc, status);
+			updated++;
+		}
+
+		int i = midi_ctl_index_find(&menu->index, ch, cc);
+		if (i < 0)
+			continue;
+
+		midi_ctl_feedback(&menu->ctls, i, cc, value, now);
+		updated++;
+
+		// Controllers forwarded as they are have been noted by the sender already.
+		// If the sender can't be told, its last-sent value can't be trusted anymore.
+		if (ev.forwarded)
+			continue;
+		else if (!midi_out_note_cc(out, ch, cc, value))
+			noted++;
+		else
+			bitset_set(menu->ctls.force, i);
+	}
+
+	if (noted)
+		midi_out_commit(out);
+
+	return updated;
 }
 
 /**
 	Shows a prompt asking for a new value for a MIDI controller
 */
-void midi_ctl_value_prompt(WINDOW *win, menu_entry *ent)
+void midi_ctl_value_prompt(WINDOW *win, midi_ctl_store *ctls, int id)
 {
-	assert(ent->type == ENTRY_MIDI_CTL);
 	char *buf = draw_bottom_prompt(win, "Enter new value: ");
 	int value;
-	if (!sscanf(buf, "%d", &value) || !INRANGE(value, ent->midi_ctl.min, ent->midi_ctl.max))
+	if (!sscanf(buf, "%d", &value) || !INRANGE(value, ctls->min[id], ctls->max[id]))
 	{
 		draw_bottom_mesg(win, "Invalid value.");
 		wgetch(win);
 	}
 	else
 	{
-		midi_ctl_set(ent, value);
+		midi_ctl_set(ctls, id, value);
 	}
 	free(buf);
 }
 
 /**
-	Writes all current controller values to a file
+	Writes controller address the way it appears in dump files -
+	CC number or parameter number prefixed with 'n' (NRPN) or 'r' (RPN)
+*/
+static void dump_write_addr(FILE *f, int addr)
+{
+	if (addr >= MIDI_ADDR_RPN)
+		fprintf(f, "r%d", addr - MIDI_ADDR_RPN);
+	else if (addr >= MIDI_ADDR_NRPN)
+		fprintf(f, "n%d", addr - MIDI_ADDR_NRPN);
+	else
+		fprintf(f, "%d", addr);
+}
+
+/**
+	Writes all current controller values to a file.
+	Each line holds CC number (or (N)RPN number, or SysEx template name
+	and address), MIDI channel and value.
 
 	\note The filename input handles all characters very literally
 */
-void midi_ctl_dump_all_to_file(WINDOW *win, menu_entry *menu, int menu_size)
+void midi_ctl_dump_all_to_file(WINDOW *win, const menu_list *menu)
 {
 	char *filename = draw_bottom_prompt(win, "Dump to file: ");
 	if (isempty(filename))
@@ -392,10 +1310,47 @@ void midi_ctl_dump_all_to_file(WINDOW *win, menu_entry *menu, int menu_size)
 		return;
 	}
 
-	for (int i = 0; i < menu_size; i++)
+	const midi_ctl_store *ctls = &menu->ctls;
+	for (int i = 0; i < ctls->count; i++)
+	{
+		if (ctls->flags[i] & MIDI_CTL_SYSEX)
+		{
+			fprintf(f, "s%s", menu->sysex[ctls->cc[i]].name);
+			if (ctls->sysex_addr[i] >= 0)
+				fprintf(f, ":%x", ctls->sysex_addr[i]);
+		}
+		else
+			dump_write_addr(f, midi_ctl_addr(ctls, i));
+		fprintf(f, "\t%d\t%d\t# %s\n", midi_ctl_channel(ctls, i, menu->default_channel), ctls->value[i], menu_ctl_entry(menu, i)->text);
+	}
+
+	// Values for pages which haven't been opened yet
+	for (int ch = 0; ch < MIDI_CHANNELS; ch++)
+		for (int cc = 0; cc < MIDI_CCS; cc++)
+			if (menu->deferred[ch][cc] >= 0)
+				fprintf(f, "%d\t%d\t%d\n", cc, ch, menu->deferred[ch][cc]);
+
+	const midi_ctl_map *params = &menu->deferred_params;
+	for (int i = 0; i < params->capacity; i++)
+	{
+		if (params->keys[i] == MIDI_CTL_MAP_EMPTY)
+			continue;
+
+		dump_write_addr(f, params->keys[i] % MIDI_ADDRS);
+		fprintf(f, "\t%d\t%d\n", (int)(params->keys[i] / MIDI_ADDRS), params->values[i]);
+	}
+
+	const midi_ctl_map *sysex = &menu->deferred_sysex;
+	for (int i = 0; i < sysex->capacity; i++)
 	{
-		if (menu[i].type == ENTRY_MIDI_CTL)
-			fprintf(f, "%d\t%d\t# %s\n", menu[i].midi_ctl.cc, menu[i].midi_ctl.value, menu[i].text);
+		if (sysex->keys[i] == MIDI_CTL_MAP_EMPTY)
+			continue;
+
+		int addr = (int32_t) sysex->keys[i];
+		fprintf(f, "s%s", menu->deferred_names[sysex->keys[i] >> 32]);
+		if (addr >= 0)
+			fprintf(f, ":%x", addr);
+		fprintf(f, "\t%d\t%d\n", menu->default_channel, sysex->values[i]);
 	}
 
 	fclose(f);
@@ -403,10 +1358,13 @@ void midi_ctl_dump_all_to_file(WINDOW *win, menu_entry *menu, int menu_size)
 
 /**
 	Load controller values from dump file generated by
-	midi_ctl_dump_all_to_file()
+	midi_ctl_dump_all_to_file(). Values of controllers which
+	haven't been loaded yet are kept until their page is opened.
+	Dumps without the channel column apply to the default channel.
 */
-void midi_ctl_load_from_dump_file(WINDOW *win, menu_entry *menu, int menu_size)
+void midi_ctl_load_from_dump_file(WINDOW *win, menu_list *menu)
 {
+	midi_ctl_store *ctls = &menu->ctls;
 	char *filename = draw_bottom_prompt(win, "Load from file: ");
 	if (isempty(filename))
 	{
@@ -429,22 +1387,61 @@ void midi_ctl_load_from_dump_file(WINDOW *win, menu_entry *menu, int menu_size)
 	size_t line_len = 0;
 	while (!errstr && getline(&line, &line_len, f) > 0)
 	{
-		int cc, value;
-		if (sscanf(line, "%d %d", &cc, &value) != 2)
-		{
-			errstr = "Invalid syntax!";
-			break;
-		}
-
-		// Search for the controller in the menu
-		for (int i = 0; !errstr && i < menu_size; i++)
+		// Parameter numbers are prefixed with 'n' or 'r'
+		const char *p = line + strspn(line, " \t");
+		int base = 0, count = MIDI_CCS;
+		if (*p == 's')
 		{
-			if (menu[i].type == ENTRY_MIDI_CTL && menu[i].midi_ctl.cc == cc)
+			// SysEx controllers - 's<template>[:<address>]'
+			const char *name = p + 1;
+			int name_len = strcspn(name, ": \t\r\n");
+			int addr = -1;
+			int ch, value;
+			int n = name[name_len] == ':'
+				? sscanf(name + name_len + 1, "%x %d %d", &addr, &ch, &value) - 1
+				: sscanf(name + name_len, "%d %d", &ch, &value);
+			if (n != 2 || addr < -1)
 			{
-				midi_ctl_set(&menu[i], value);
+				errstr = "Invalid syntax!";
 				break;
 			}
+
+			int t = menu_find_sysex(menu, name, name_len);
+			int i = t >= 0 ? midi_ctl_index_find_sysex(&menu->index, t, addr) : -1;
+			if (i >= 0)
+				midi_ctl_set(ctls, i, value);
+			else if (menu_defer_sysex(menu, name, name_len, addr, value))
+				errstr = "Out of memory!";
+			continue;
+		}
+		else if (*p == 'n' || *p == 'r')
+		{
+			base = *p == 'n' ? MIDI_ADDR_NRPN : MIDI_ADDR_RPN;
+			count = MIDI_PARAMS;
+			p++;
+		}
+
+		int cc, ch, value;
+		int n = sscanf(p, "%d %d %d", &cc, &ch, &value);
+		if (n == 2)
+		{
+			value = ch;
+			ch = menu->default_channel;
 		}
+		else if (n != 3)
+		{
+			errstr = "Invalid syntax!";
+			break;
+		}
+
+		if (!INRANGE(cc, 0, count - 1) || !INRANGE(ch, 0, MIDI_CHANNELS - 1))
+			continue;
+
+		int i = midi_ctl_index_find(&menu->index, ch, base + cc);
+		if (i >= 0)
+			midi_ctl_set(ctls, i, value);
+		else if (menu_defer_value(menu, ch, base + cc, value))
+			errstr = "Out of memory!";
 	}
 	free(line);
 	fclose(f);
@@ -456,6 +1453,344 @@ void midi_ctl_load_from_dump_file(WINDOW *win, menu_entry *menu, int menu_size)
 	}
 }
 
+/**
+	Renderer statistics
+*/
+typedef struct frame_stats
+{
+	unsigned int drawn;     //!< Frames drawn
+	unsigned int coalesced; //!< State changes merged into another frame
+} frame_stats;
+
+/**
+	Puts MIDI I/O and renderer statistics in the status message
+*/
+void midi_show_stats(midictl_alsa_seq *seq, midi_out *out, midi_in *in, frame_stats *frames, char *status)
+{
+	uint64_t count, avg, max;
+	midi_out_thru_stats(out, &count, &avg, &max);
+	snprintf(status, STATUS_SIZE, "Thru: %llu, avg %llu us, max %llu us | Skipped: %u (parameter selections: %u) | Overruns: %u, dropped: %u | Frames: %u, coalesced: %u",
+		(unsigned long long) count, (unsigned long long) avg / 1000, (unsigned long long) max / 1000,
+		__atomic_load_n(&out->sent_skipped, __ATOMIC_RELAXED),
+		__atomic_load_n(&out->select_skipped, __ATOMIC_RELAXED),
+		__atomic_load_n(&seq->input_overruns, __ATOMIC_RELAXED),
+		__atomic_load_n(&in->dropped, __ATOMIC_RELAXED),
+		frames->drawn, frames->coalesced);
+}
+
+/**
+	Resizes ncurses screen to the current terminal size
+*/
+void handle_resize(void)
+{
+	struct winsize ws;
+	if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == 0)
+		resizeterm(ws.ws_row, ws.ws_col);
+}
+
+/**
+	Makes a page current, loading it if needed. Errors are put
+	in the status message.
+
+	\returns 0 on success
+*/
+int menu_open_page_status(menu_list *menu, int page, char *status)
+{
+	char *error = NULL;
+	size_t error_size;
+	FILE *errf = open_memstream(&error, &error_size);
+	if (!errf)
+		return 1;
+
+	int err = menu_open_page(menu, page, errf);
+	fclose(errf);
+
+	// Messages are shown in one line
+	for (char *p = error; p && *p; p++)
+		if (*p == '\n')
+			*p = p[1] ? ' ' : 0;
+
+	if (err)
+		snprintf(status, STATUS_SIZE, "%s", error ? error : "Could not open page!");
+	free(error);
+	return err;
+}
+
+/**
+	Switches to another page. The cursor position is
+	remembered for each page.
+*/
+void menu_change_page(menu_list *menu, int *cursor, int page, char *status)
+{
+	page = (page + menu->page_count) % menu->page_count;
+	if (page == menu->page)
+		return;
+
+	int prev = menu->page;
+	if (menu_open_page_status(menu, page, status))
+		return;
+
+	menu->pages[prev].cursor = *cursor;
+	*cursor = menu->pages[page].cursor;
+	if (*cursor < 0)
+	{
+		*cursor = 0;
+		menu_view all = menu_view_all(menu);
+		menu_move_cursor(&all, cursor, 0);
+	}
+
+	const char *name = menu->pages[page].name;
+	snprintf(status, STATUS_SIZE, "Page %d/%d: %s", page + 1, menu->page_count, name ? name : "(unnamed)");
+}
+
+/**
+	Collapses the sections of a reloaded page whose headings
+	were collapsed in its old version
+*/
+static void menu_reload_sections(const menu_list *old, int old_page, menu_list *menu, int page)
+{
+	const menu_page *op = &old->pages[old_page];
+	menu_page *np = &menu->pages[page];
+	const menu_entry *old_entries = old_page == old->page ? old->entries : op->entries;
+	const menu_entry *entries = page == menu->page ? menu->entries : np->entries;
+
+	for (int i = 0; i < op->section_count; i++)
+	{
+		if (!bitset_test(op->collapsed, i))
+			continue;
+
+		const char *text = old_entries[op->sections[i].entry].text;
+		for (int j = 0; j < np->section_count; j++)
+		{
+			const char *t = entries[np->sections[j].entry].text;
+			if (!bitset_test(np->collapsed, j) && (t == text || (t && text && !strcmp(t, text))))
+			{
+				bitset_set(np->collapsed, j);
+				np->collapsed_count++;
+				break;
+			}
+		}
+	}
+}
+
+/**
+	Replaces the menu with the one reloaded by the config watcher.
+	Controllers are matched by (channel, cc) or (template, address). The ones which are still
+	there keep their current values, so nothing is sent for them unless
+	the value no longer fits the new range. New controllers behave as on
+	startup - they are sent only if they have the 'update' key.
+	Pages which have been opened have been opened in the new menu
+	by the watcher as well and sections stay collapsed.
+*/
+void menu_reload(config_watch *watch, menu_list *menu, int *cursor, char *status, midi_out *out)
+{
+	menu_list new_menu;
+	char *error;
+	int taken = config_watch_take(watch, &new_menu, &error);
+	if (!taken)
+		return;
+
+	if (taken < 0)
+	{
+		snprintf(status, STATUS_SIZE, "Config reload failed: %s", error);
+		free(error);
+		return;
+	}
+
+	// Pages which could not be opened - their controllers count as removed
+	if (error)
+	{
+		snprintf(status, STATUS_SIZE, "%s", error);
+		free(error);
+	}
+
+	// Values loaded from a dump for pages not opened yet
+	if (menu_copy_deferred(&new_menu, menu))
+	{
+		snprintf(status, STATUS_SIZE, "Config reload failed: out of memory");
+		menu_list_destroy(&new_menu);
+		return;
+	}
+
+	// Stay on the same page. The watcher has opened the pages
+	// which were open, so nothing has to be parsed here.
+	int page = menu_find_page(&new_menu, menu->pages[menu->page].name);
+	if (page < 0 || !new_menu.pages[page].loaded)
+		page = 0;
+	menu_open_page_status(&new_menu, page, status);
+
+	for (int p = 0; p < menu->page_count; p++)
+	{
+		int np = menu_find_page(&new_menu, menu->pages[p].name);
+		if (np >= 0 && menu->pages[p].loaded && new_menu.pages[np].loaded)
+			menu_reload_sections(menu, p, &new_menu, np);
+	}
+
+	midi_ctl_store *old = &menu->ctls;
+	midi_ctl_store *ctls = &new_menu.ctls;
+	int active = menu->entries[*cursor].type == ENTRY_MIDI_CTL ? menu->entries[*cursor].ctl : -1;
+	int new_cursor = -1;
+	int kept = 0;
+
+	// The sender keeps SysEx values by controller ID, which means something
+	// else from now on. Values still waiting are sent again from the new menu.
+	for (int j = 0; j < old->count; j++)
+		if ((old->flags[j] & MIDI_CTL_SYSEX) && midi_out_sysex_withdraw(out, j))
+			bitset_set(old->changed, j);
+	midi_out_sysex_forget(out);
+
+	for (int i = 0; i < ctls->count; i++)
+	{
+		int ch = midi_ctl_channel(ctls, i, new_menu.default_channel);
+		int addr = midi_ctl_addr(ctls, i);
+		int j;
+		if (addr < 0)
+		{
+			// Template indices may differ between the configs
+			const char *name = new_menu.sysex[ctls->cc[i]].name;
+			int t = menu_find_sysex(menu, name, strlen(name));
+			j = t >= 0 ? midi_ctl_index_find_sysex(&menu->index, t, ctls->sysex_addr[i]) : -1;
+		}
+		else
+			j = midi_ctl_index_find(&menu->index, ch, addr);
+
+		if (j < 0)
+		{
+			// A controller moved from a page which hasn't been opened
+			int v = addr < 0
+				? menu_take_deferred_sysex(&new_menu, new_menu.sysex[ctls->cc[i]].name, ctls->sysex_addr[i])
+				: menu_take_deferred(&new_menu, ch, addr);
+			if (v >= 0)
+			{
+				v = CLAMP(v, ctls->min[i], ctls->max[i]);
+				if (v != ctls->value[i])
+					bitset_set(ctls->changed, i);
+				ctls->value[i] = v;
+			}
+			continue;
+		}
+
+		// Carry over the value and anything still waiting to be sent
+		ctls->value[i] = CLAMP(old->value[j], ctls->min[i], ctls->max[i]);
+		ctls->activity[i] = old->activity[j];
+		if (ctls->value[i] != old->value[j] || bitset_test(old->changed, j))
+			bitset_set(ctls->changed, i);
+		else
+			bitset_clear(ctls->changed, i);
+		if (bitset_test(old->force, j))
+			bitset_set(ctls->force, i);
+
+		if (j == active && ctls->page[i] == new_menu.page)
+			new_cursor = ctls->entry[i];
+		kept++;
+	}
+
+	int added = ctls->count - kept;
+	int removed = old->count - kept;
+
+	menu_list_destroy(menu);
+	*menu = new_menu;
+
+	// Stay on the same controller if it's still there
+	if (new_cursor >= 0)
+		*cursor = new_cursor;
+	else
+	{
+		*cursor = MAX(MIN(*cursor, menu->size - 1), 0);
+		menu_view all = menu_view_all(menu);
+		menu_move_cursor(&all, cursor, 0);
+	}
+
+	// The controller might be in a collapsed section now
+	const menu_page *cur = &menu->pages[menu->page];
+	int sec = menu_section_find(cur, *cursor);
+	if (sec >= 0 && bitset_test(cur->collapsed, sec))
+		*cursor = cur->sections[sec].entry;
+
+	// Don't cover other messages (e.g. after MIDI learn has rewritten the config)
+	if (!status[0])
+		snprintf(status, STATUS_SIZE, "Config reloaded: %d controllers added, %d removed", added, removed);
+}
+
+/**
+	\returns whether the key adjusts the selected controller
+*/
+int menu_ctl_key(int c)
+{
+	switch (c)
+	{
+		case KEY_ENTER: case '\n': case '\r': case 'i':
+		case KEY_RIGHT: case 'l': case 'L': case ';': case 'C':
+		case KEY_LEFT: case 'h': case 'H': case 'g': case 'Z':
+		case 'z': case 'x': case 'c': case 'r': case 't': case 'm':
+			return 1;
+	}
+	return 0;
+}
+
+/**
+	Returned by main_wait() when the timeout expires
+*/
+#define MAIN_WAIT_TIMEOUT (-2)
+
+/**
+	Returned by main_wait() when the config has been reloaded
+*/
+#define MAIN_WAIT_RELOAD (-3)
+
+/**
+	Waits for a key press, handling all other events in the meantime.
+	Nothing is done between events - the process sleeps in poll().
+
+	\param timeout_ms Maximum time to wait (-1 for no limit), events
+		which need no redraw don't extend it
+	\returns key code, ERR if the screen needs redrawing for other reasons,
+		MAIN_WAIT_RELOAD if a new version of the config is waiting
+		or MAIN_WAIT_TIMEOUT if nothing has happened
+*/
+int main_wait(WINDOW *win, event_loop *loop, int timeout_ms, midi_in *in, menu_list *menu, midi_out *out, midi_learn_state *learn, char *status)
+{
+	uint64_t deadline = monotonic_ns() + (uint64_t) MAX(timeout_ms, 0) * 1000000;
+	for (int first = 1; ; first = 0)
+	{
+		// Keys may already be waiting in ncurses' buffer
+		wtimeout(win, 0);
+		int c = wgetch(win);
+		wtimeout(win, -1);
+		if (c != ERR)
+			return c;
+
+		int remaining = -1;
+		if (timeout_ms >= 0)
+		{
+			uint64_t now = monotonic_ns();
+			if (now >= deadline && !first)
+				return MAIN_WAIT_TIMEOUT;
+			remaining = now < deadline ? (deadline - now + 999999) / 1000000 : 0;
+		}
+
+		int ready = event_loop_wait(loop, remaining);
+		if (!ready)
+			return MAIN_WAIT_TIMEOUT;
+
+		if (ready & EVENT_LOOP_MIDI_IN)
+			if (midi_in_handle(in, menu, out, learn, status))
+				return ERR;
+
+		if (ready & EVENT_LOOP_RESIZE)
+		{
+			handle_resize();
+			return ERR;
+		}
+
+		if (ready & EVENT_LOOP_RELOAD)
+			return MAIN_WAIT_RELOAD;
+
+		if (ready & EVENT_LOOP_TIMER)
+			return ERR;
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	// Parse command line args
@@ -467,21 +1802,61 @@ int main(int argc, char *argv[])
 
 	int default_midi_channel = config.midi_channel;
 
+	// SIGWINCH is handled through the event loop - block it before any threads are started
+	if (event_loop_block_signals())
+	{
+		fprintf(stderr, "Failed to set signal mask!\n");
+		exit(EXIT_FAILURE);
+	}
+
 	// Init ALSA seq
 	midictl_alsa_seq midi_seq;
-	if (alsa_seq_init(&midi_seq, config.midi_device, config.midi_port))
+	if (alsa_seq_init(&midi_seq, config.midi_device, config.midi_port, config.direct))
 	{
 		fprintf(stderr, "ALSA sequencer init failed!\n");
 		exit(EXIT_FAILURE);
 	}
 
-	// Parser init
-	if (config_parser_init())
+	// Start MIDI sender thread
+	midi_out midi_sender;
+	if (midi_out_init(&midi_sender, &midi_seq, config.midi_rate))
 	{
-		fprintf(stderr, "Config parser init failed!\n");
+		fprintf(stderr, "MIDI sender init failed!\n");
 		exit(EXIT_FAILURE);
 	}
 
+	// Load the thru remap table
+	midi_thru_map thru_map;
+	midi_thru_map_init(&thru_map);
+	if (config.midi_map_path)
+	{
+		FILE *f = fopen(config.midi_map_path, "rt");
+		if (f == NULL)
+		{
+			fprintf(stderr, "Could not open MIDI map file: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		int err = midi_thru_map_load(&thru_map, f);
+		fclose(f);
+		if (err)
+			exit(EXIT_FAILURE);
+	}
+
+	// Subscribe to the input device and start receiving
+	midi_in midi_receiver = {.notify_fd = -1};
+	if (config.midi_in_device >= 0)
+	{
+		if (alsa_seq_connect_input(&midi_seq, config.midi_in_device, config.midi_in_port))
+			exit(EXIT_FAILURE);
+
+		if (midi_in_init(&midi_receiver, &midi_seq, config.midi_thru ? &midi_sender : NULL, &thru_map))
+		{
+			fprintf(stderr, "MIDI receiver init failed!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	bool save_config_path = 1;
 	// check if config file path is given
 	//if not open the last given path.
@@ -512,13 +1887,10 @@ int main(int argc, char *argv[])
 		save_config_path = 0;
 	}
 
-	// Open config file
-	FILE *config_file = fopen(config.config_path, "rt");
-	if (config_file == NULL)
-	{
-		fprintf(stderr, "Could not open config file: %s\n", strerror(errno));
+	// Build menu - the compiled cache is used if it matches the config
+	menu_list menu;
+	if (config_load(config.config_path, default_midi_channel, &menu, stderr))
 		exit(EXIT_FAILURE);
-	}
 
 	if (save_config_path)
 	{
@@ -535,17 +1907,21 @@ int main(int argc, char *argv[])
 			fclose(conf_path);
 		}
 	}
-	else 
-		free((void*)config.config_path);
-	
-	// Build menu
-	int menu_size = 0;
-	menu_entry *menu = build_menu_from_config_file(config_file, &menu_size);
-	if (menu == NULL)
-		exit(EXIT_FAILURE);
-	
-	// Close config file
-	fclose(config_file);
+
+	midi_ctl_store *ctls = &menu.ctls;
+
+	// Reload the config whenever it changes
+	config_watch watch;
+	if (config_watch_init(&watch, config.config_path, default_midi_channel))
+		fprintf(stderr, "The config will not be reloaded when it changes.\n");
+
+	midi_learn_state learn = {
+		.ctl = -1,
+		.config_path = config.config_path,
+	};
+
+	// Status message shown on the bottom line until a key is pressed
+	char status[STATUS_SIZE] = {0};
 	
 	// Ncurses init
 	WINDOW *win = initscr();
@@ -556,20 +1932,40 @@ int main(int argc, char *argv[])
 	}
 
 	keypad(win, TRUE);
+	set_escdelay(25);
 	curs_set(0);
 	noecho();
 
+	// Event loop init
+	event_loop loop;
+	if (event_loop_init(&loop, midi_receiver.notify_fd, watch.notify_fd))
+	{
+		endwin();
+		fprintf(stderr, "Event loop init failed!\n");
+		exit(EXIT_FAILURE);
+	}
+
 	// UI setup - make sure we start on the top
+	menu_renderer renderer = {0};
 	int menu_cursor = 1;
 	int menu_viewport = 0;
 	int menu_show_lcol = 1;
 	float menu_split = 0.5;
-	menu_move_cursor(menu, menu_size, &menu_cursor, -1);
+	menu_filter filter = {0};
+	menu_outline outline = {0};
+	menu_view view = menu_view_all(&menu);
+	menu_move_cursor(&view, &menu_cursor, -1);
 
 	// Update changed controllers
-	// At this point only controllers with default value have 'changed' flag set
-	// see: config_parser.c
-	midi_ctl_update_changed(menu, menu_size, &midi_seq, default_midi_channel);
+	// At this point only controllers with 'update' key have 'changed' flag set
+	// see: ctl_store.c
+	int midi_pending = midi_ctl_update_changed(&menu, menu.entries[menu_cursor].ctl, &midi_sender, default_midi_channel);
+
+	// Frame rate cap - state changes arriving within one frame are drawn together
+	uint64_t frame_ns = config.fps ? 1000000000ull / config.fps : 0;
+	uint64_t last_frame = 0;
+	int dirty = 1;
+	frame_stats frames = {0};
 
 	// The main loop
 	int active = 1;
@@ -581,22 +1977,98 @@ int main(int argc, char *argv[])
 		(void) win_w;
 		
 		// Make sure cursor is in the viewport
-		if (menu_cursor - menu_viewport < 0)
-			menu_viewport = menu_cursor;
-		if (menu_cursor - menu_viewport >= win_h)
-			menu_viewport = menu_cursor - win_h + 1;
+		if (!filter.active)
+			menu_reveal_cursor(&menu, &outline, menu_cursor);
+		view = filter.active ? menu_filter_view(&filter, &menu) : menu_outline_view(&outline, &menu);
+		menu_viewport = menu_viewport_follow(menu_viewport, menu_view_row(&view, menu_cursor), view.size, win_h);
 		
-		// Currently selected menu entry
-		menu_entry *active_entry = &menu[menu_cursor];
+		// Currently selected controller (none on a collapsed section's heading)
+		int active_ctl = menu.entries[menu_cursor].type == ENTRY_MIDI_CTL ? menu.entries[menu_cursor].ctl : -1;
 		
-		// Draw
-		clear();
-		menu_split = CLAMP(menu_split, 0.2f, 0.8f);
-		draw_menu(win, menu, menu_size, menu_viewport, menu_cursor, menu_split, menu_show_lcol);
-		refresh();
+		// Draw if anything has changed and the frame time has come
+		uint64_t now = monotonic_ns();
+		if (dirty && now - last_frame >= frame_ns)
+		{
+			menu_split = CLAMP(menu_split, 0.2f, 0.8f);
+			draw_menu(win, &renderer, &menu, &view, menu_viewport, menu_cursor, menu_split, menu_show_lcol, now);
+			unsigned int bulk_done, bulk_total;
+			int bulk_active = midi_out_bulk_progress(&midi_sender, &bulk_done, &bulk_total);
+			if (filter.editing)
+				draw_bottom_mesg(win, "Search: %s - %d found (Enter to keep, Esc to cancel)", filter.query, filter.count);
+			else if (learn.ctl >= 0)
+				draw_bottom_mesg(win, "MIDI learn: move a controller on the device (any key to cancel)");
+			else if (status[0])
+				draw_bottom_mesg(win, "%s", status);
+			else if (midi_pending)
+				draw_bottom_mesg(win, "MIDI output queue full - %d controllers pending", midi_pending);
+			else if (bulk_active)
+				draw_bottom_mesg(win, "Transmitting... %u/%u", bulk_done, bulk_total);
+			wnoutrefresh(win);
+			doupdate();
+
+			// Keep refreshing the progress while anything is being sent in the background
+			// and until the activity markers fade out
+			int activity = midi_ctl_activity_visible(&menu, &view, menu_viewport, win_h, now);
+			event_loop_set_timer(&loop, bulk_active || midi_pending || activity ? 100 : 0);
+
+			last_frame = now;
+			dirty = 0;
+			frames.drawn++;
+		}
+
+		// If a frame is due, wait only until it's time to draw it
+		int timeout = -1;
+		if (dirty)
+			timeout = (last_frame + frame_ns - now + 999999) / 1000000;
 
 		// Handle user input
-		int c = wgetch(win);
+		int c = main_wait(win, &loop, timeout, &midi_receiver, &menu, &midi_sender, &learn, status);
+		if (c == MAIN_WAIT_TIMEOUT)
+			continue;
+
+		// New version of the config
+		if (c == MAIN_WAIT_RELOAD)
+		{
+			if (learn.ctl >= 0)
+				learn.ctl = -1;
+			menu_filter_clear(&filter, &menu_cursor, 1);
+			menu_reload(&watch, &menu, &menu_cursor, status, &midi_sender);
+			config_watch_set_pages(&watch, &menu);
+			outline.valid = 0;
+			renderer.full = 1;
+			c = ERR;
+		}
+
+		// Another change before the previous one has been drawn
+		if (dirty)
+			frames.coalesced++;
+		dirty = 1;
+
+		// Any key cancels MIDI learn and dismisses the status message
+		if (c != ERR && c != KEY_RESIZE)
+		{
+			status[0] = 0;
+			if (learn.ctl >= 0)
+			{
+				learn.ctl = -1;
+				continue;
+			}
+		}
+
+		// Keys typed into the search query
+		if (filter.editing && c != ERR && menu_filter_key(&filter, &menu, &menu_cursor, c))
+			c = ERR;
+
+		// The menu may have changed
+		if (!filter.active)
+			menu_reveal_cursor(&menu, &outline, menu_cursor);
+		view = filter.active ? menu_filter_view(&filter, &menu) : menu_outline_view(&outline, &menu);
+		active_ctl = menu.entries[menu_cursor].type == ENTRY_MIDI_CTL ? menu.entries[menu_cursor].ctl : -1;
+
+		// Nothing to adjust on a heading
+		if (active_ctl < 0 && menu_ctl_key(c))
+			c = ERR;
+
 		switch (c)
 		{
 			// Quit
@@ -609,115 +2081,164 @@ int main(int argc, char *argv[])
 			case '\n':
 			case '\r':
 			case 'i':
-				midi_ctl_value_prompt(win, active_entry);
+				midi_ctl_value_prompt(win, ctls, active_ctl);
 				break;
 
 			// Previous controller
 			case KEY_UP:
 			case 'k':
-				menu_move_cursor(menu, menu_size, &menu_cursor, -1);
+				menu_move_cursor(&view, &menu_cursor, -1);
 				break;
 
 			// Previous page
 			case KEY_PPAGE:
-				menu_move_cursor(menu, menu_size, &menu_cursor, -win_h);
+				menu_move_cursor(&view, &menu_cursor, -win_h);
 				break;
 
 			// Next controller
 			case KEY_DOWN:
 			case 'j':
-				menu_move_cursor(menu, menu_size, &menu_cursor, 1);
+				menu_move_cursor(&view, &menu_cursor, 1);
 				break;
 
 			// Next page
 			case KEY_NPAGE:
-				menu_move_cursor(menu, menu_size, &menu_cursor, win_h);
+				menu_move_cursor(&view, &menu_cursor, win_h);
 				break;
 
 			// Jump to the end of the list
 			case KEY_END:
-				menu_move_cursor(menu, menu_size, &menu_cursor, menu_size);
+				menu_move_cursor(&view, &menu_cursor, view.size);
 				break;
 
 			// Jump to the beginning of the list
 			case KEY_HOME:
-				menu_move_cursor(menu, menu_size, &menu_cursor, -menu_size);
+				menu_move_cursor(&view, &menu_cursor, -view.size);
 				break;
 
 			// Increment value
 			case KEY_RIGHT:
 			case 'l':
-				midi_ctl_set(active_entry, active_entry->midi_ctl.value + 1);
+				midi_ctl_set(ctls, active_ctl, ctls->value[active_ctl] + 1);
 				break;
 
 			// Increment value (big step)
 			case 'L':
 			case ';':
 			case 'C':
-				midi_ctl_set(active_entry, active_entry->midi_ctl.value + 10);
+				midi_ctl_set(ctls, active_ctl, ctls->value[active_ctl] + midi_ctl_coarse_step(ctls, active_ctl));
 				break;
 
 			// Decrement value
 			case 'h':
 			case KEY_LEFT:
-				midi_ctl_set(active_entry, active_entry->midi_ctl.value - 1);
+				midi_ctl_set(ctls, active_ctl, ctls->value[active_ctl] - 1);
 				break;
 
 			// Decrement value (big step)
 			case 'H':
 			case 'g':
 			case 'Z':
-				midi_ctl_set(active_entry, active_entry->midi_ctl.value - 10);
+				midi_ctl_set(ctls, active_ctl, ctls->value[active_ctl] - midi_ctl_coarse_step(ctls, active_ctl));
 				break;
 
 			// Set to min
 			case 'z':
-				midi_ctl_set(active_entry, active_entry->midi_ctl.min);
+				midi_ctl_set(ctls, active_ctl, ctls->min[active_ctl]);
 				break;
 
 			// Set to center
 			case 'x':
-				midi_ctl_set(active_entry, (active_entry->midi_ctl.max + active_entry->midi_ctl.min) / 2);
+				midi_ctl_set(ctls, active_ctl, (ctls->max[active_ctl] + ctls->min[active_ctl]) / 2);
 				break;
 
 			// Set to max
 			case 'c':
-				midi_ctl_set(active_entry, active_entry->midi_ctl.max);
+				midi_ctl_set(ctls, active_ctl, ctls->max[active_ctl]);
 				break;
 
 			// Set to default (reset)
 			case 'r':
-				midi_ctl_reset(active_entry);
+				midi_ctl_reset(ctls, active_ctl);
 				break;
 
 			// Retransmit
 			case 't':
-				midi_ctl_touch(active_entry);
+				midi_ctl_touch(ctls, active_ctl);
 				break;
 
 			// Reset all
 			case 'R':
-				midi_ctl_reset_all(menu, menu_size);
+				midi_ctl_reset_all(ctls);
 				break;
 
 			// Retransmit
 			case 'T':
-				midi_ctl_touch_all(menu, menu_size);
+				midi_ctl_touch_all(ctls);
 				break;
 
 			// Dump all to file
 			case 'D':
-				midi_ctl_dump_all_to_file(win, menu, menu_size);
+				midi_ctl_dump_all_to_file(win, &menu);
 				break;
 
 			// Load dump file
 			case 'O':
-				midi_ctl_load_from_dump_file(win, menu, menu_size);
+				midi_ctl_load_from_dump_file(win, &menu);
+				break;
+
+			// MIDI learn
+			case 'm':
+				if (config.midi_in_device < 0)
+					snprintf(status, sizeof(status), "MIDI learn requires an input device (-i)");
+				else
+					learn.ctl = active_ctl;
+				break;
+
+			// Show statistics
+			case 'S':
+				midi_show_stats(&midi_seq, &midi_sender, &midi_receiver, &frames, status);
+				break;
+
+			// Next config page
+			case '\t':
+				menu_filter_clear(&filter, &menu_cursor, 1);
+				menu_change_page(&menu, &menu_cursor, menu.page + 1, status);
+				config_watch_set_pages(&watch, &menu);
+				outline.valid = 0;
+				renderer.full = 1;
+				break;
+
+			// Previous config page
+			case KEY_BTAB:
+				menu_filter_clear(&filter, &menu_cursor, 1);
+				menu_change_page(&menu, &menu_cursor, menu.page - 1, status);
+				config_watch_set_pages(&watch, &menu);
+				outline.valid = 0;
+				renderer.full = 1;
 				break;
 
 			// Search
 			case '/':
-				menu_search(win, menu, menu_size, ENTRY_MIDI_CTL, &menu_cursor);
+				if (menu_filter_start(&filter, &menu, &menu_cursor))
+					snprintf(status, sizeof(status), "Out of memory!");
+				break;
+
+			// Collapse/expand section
+			case ' ':
+				menu_filter_clear(&filter, &menu_cursor, 1);
+				menu_toggle_section(&menu, &outline, &menu_cursor);
+				break;
+
+			// Collapse/expand all sections
+			case 'F':
+				menu_filter_clear(&filter, &menu_cursor, 1);
+				menu_toggle_all_sections(&menu, &outline, &menu_cursor);
+				break;
+
+			// Show all controllers after search
+			case 27:
+				menu_filter_clear(&filter, &menu_cursor, 1);
 				break;
 
 			// Toggle left column visibility
@@ -737,19 +2258,25 @@ int main(int argc, char *argv[])
 		}
 
 		// Update all changed controllers
-		midi_ctl_update_changed(menu, menu_size, &midi_seq, default_midi_channel);
+		midi_pending = midi_ctl_update_changed(&menu, active_ctl, &midi_sender, default_midi_channel);
 	}
 
 	// Destroy the menu
-	for (int i = 0; i < menu_size; i++)
-		free(menu[i].text);
-	free(menu);
+	menu_list_destroy(&menu);
 	
-	// Free search cache
-	menu_search(NULL, NULL, 0, 0, NULL);
+	menu_filter_destroy(&filter);
+	menu_outline_destroy(&outline);
+
+	menu_renderer_destroy(&renderer);
 
 	endwin();
+	if (!save_config_path)
+		free(config.config_path);
+	event_loop_destroy(&loop);
+	config_watch_destroy(&watch);
+	if (config.midi_in_device >= 0)
+		midi_in_destroy(&midi_receiver);
+	midi_out_destroy(&midi_sender);
 	alsa_seq_destroy(&midi_seq);
-	config_parser_destroy();
 	return 0;
 }
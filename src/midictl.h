@@ -1,6 +1,17 @@
 #ifndef MIDICTL_H
 #define MIDICTL_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include "strpool.h"
+#include "ctl_store.h"
+#include "sysex.h"
+
+/**
+	For how long incoming activity is shown next to a controller (ns)
+*/
+#define MIDI_CTL_ACTIVITY_NS 500000000ull
+
 /**
 	Configuration from command line arguments
 */
@@ -9,11 +20,21 @@ typedef struct midictl_args
 	int midi_device;
 	int midi_port;
 	int midi_channel;
+	int direct; //!< Direct (queue-less, non-blocking) dispatch mode
+	int midi_rate; //!< Output rate limit in bytes per second
+	int midi_in_device; //!< Source MIDI client (-1 if none)
+	int midi_in_port;
+	int midi_thru; //!< Forward input to the destination device
+	int fps;       //!< Screen refresh rate limit (0 for none)
 
 	char *config_path;
+	const char *midi_map_path;
 	const char *midi_device_str;
 	const char *midi_port_str;
 	const char *midi_channel_str;
+	const char *midi_rate_str;
+	const char *midi_in_str;
+	const char *fps_str;
 } midictl_args;
 
 /**
@@ -32,19 +53,81 @@ typedef struct menu_entry
 {
 	menu_entry_type type;
 	char *text;
-
-	// ENTRY_MIDI_CTL
-	struct
-	{
-		int cc;
-		int value;
-		int min;
-		int max;
-		int def;     //!< Default value (-1 to ignore)
-		int channel; //!< MIDI channel (-1 to use default)
-		int slider;  //!< Should slider be displayed
-		int changed; //!< Non-zero if the value needs retransmitting to the device
-	} midi_ctl;
+	const char *folded; //!< Lowercase label for searching (ENTRY_MIDI_CTL only)
+	const char *file; //!< Included file the entry comes from (NULL for the main config)
+	int line; //!< Config file line the entry comes from
+	int ctl;  //!< Controller ID in the store (ENTRY_MIDI_CTL only)
 } menu_entry;
 
+/**
+	A section of a page - a heading (horizontal rule) and everything
+	up to the next one. Sections can be collapsed.
+*/
+typedef struct menu_section
+{
+	int entry;     //!< The heading entry
+	int first_ctl; //!< First controller after the heading
+} menu_section;
+
+/**
+	A page of the menu. Pages are parsed only when they're opened for the first time.
+*/
+typedef struct menu_page
+{
+	char *name;       //!< Page name (NULL for the implicit first page)
+	long offset;      //!< Where the page's lines start in the main config
+	int first_line;   //!< Line number of the page's first line
+	int loaded;
+	int cursor;       //!< Cursor position saved when leaving the page (-1 if not set)
+	int first_ctl;    //!< First controller on the page - controllers of a page have consecutive IDs, in the order of their entries
+	int ctl_count;
+
+	menu_section *sections; //!< Sections in the order of their headings
+	int section_count;
+	uint64_t *collapsed;    //!< Bitset of collapsed sections
+	int collapsed_count;
+
+	// Page contents - only valid when it's not the current page
+	menu_entry *entries;
+	int size;
+	int capacity;
+	strpool labels;
+} menu_page;
+
+/**
+	All menu entries loaded from the config. The entries of the current
+	page are kept directly here and are swapped with the page when another
+	one is opened. Entry labels point into the page's interned string block.
+*/
+typedef struct menu_list
+{
+	menu_entry *entries; //!< Entries of the current page
+	int size;
+	int capacity;
+	strpool labels;      //!< Labels of the current page
+	midi_ctl_store ctls; //!< State of the controllers on all loaded pages
+
+	menu_page *pages;
+	int page_count;
+	int page;            //!< Current page
+
+	char *path;          //!< Main config path (for loading pages)
+	char **files;        //!< Included files
+	int file_count;
+
+	sysex_template *sysex;      //!< SysEx templates, referred to by index
+	int sysex_count;
+
+	int default_channel;        //!< MIDI channel of controllers without 'chan' key
+	midi_ctl_index index;       //!< Controllers on all loaded pages
+	int16_t deferred[MIDI_CHANNELS][MIDI_CCS]; //!< Values waiting for CC controllers on pages which are not loaded yet (-1 if none)
+	midi_ctl_map deferred_params;              //!< The same for (N)RPN controllers, keyed with midi_ctl_key()
+	midi_ctl_map deferred_sysex;               //!< The same for SysEx controllers, keyed with midi_ctl_sysex_key() and index in deferred_names
+	char **deferred_names;                     //!< Template names of deferred SysEx values (the templates may not be loaded yet)
+	int deferred_name_count;
+
+	void *map;       //!< Mapped config cache the labels point into (NULL if none)
+	size_t map_size;
+} menu_list;
+
 #endif
\ No newline at end of file
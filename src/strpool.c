@@ -0,0 +1,106 @@
+#include "strpool.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+	FNV-1a hash
+*/
+static uint32_t strpool_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= (unsigned char) s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+	Doubles the hash table size and reinserts all strings
+*/
+static int strpool_grow_table(strpool *pool)
+{
+	size_t size = pool->table_size ? pool->table_size * 2 : 256;
+	uint32_t *table = calloc(size, sizeof(uint32_t));
+	if (!table)
+		return 1;
+
+	for (size_t i = 0; i < pool->table_size; i++)
+	{
+		uint32_t entry = pool->table[i];
+		if (!entry)
+			continue;
+
+		const char *s = pool->data + entry - 1;
+		size_t slot = strpool_hash(s, strlen(s)) & (size - 1);
+		while (table[slot])
+			slot = (slot + 1) & (size - 1);
+		table[slot] = entry;
+	}
+
+	free(pool->table);
+	pool->table = table;
+	pool->table_size = size;
+	return 0;
+}
+
+void strpool_init(strpool *pool)
+{
+	memset(pool, 0, sizeof(*pool));
+}
+
+/**
+	Adds a string (not necessarily null-terminated) to the pool,
+	unless an identical one is already there.
+
+	\returns offset of the string in the block or -1 if out of memory
+*/
+long strpool_intern(strpool *pool, const char *s, size_t len)
+{
+	// Keep the load factor below 1/2
+	if ((pool->count + 1) * 2 > pool->table_size && strpool_grow_table(pool))
+		return -1;
+
+	size_t mask = pool->table_size - 1;
+	size_t slot = strpool_hash(s, len) & mask;
+	for (; pool->table[slot]; slot = (slot + 1) & mask)
+	{
+		const char *t = pool->data + pool->table[slot] - 1;
+		if (!strncmp(t, s, len) && t[len] == 0)
+			return pool->table[slot] - 1;
+	}
+
+	// Make room in the block
+	if (pool->size + len + 1 > pool->capacity)
+	{
+		size_t capacity = pool->capacity ? pool->capacity : 4096;
+		while (pool->size + len + 1 > capacity)
+			capacity *= 2;
+
+		if (capacity > UINT32_MAX)
+			return -1;
+
+		char *data = realloc(pool->data, capacity);
+		if (!data)
+			return -1;
+		pool->data = data;
+		pool->capacity = capacity;
+	}
+
+	long offset = pool->size;
+	memcpy(pool->data + offset, s, len);
+	pool->data[offset + len] = 0;
+	pool->size += len + 1;
+
+	pool->table[slot] = offset + 1;
+	pool->count++;
+	return offset;
+}
+
+void strpool_destroy(strpool *pool)
+{
+	free(pool->data);
+	free(pool->table);
+	memset(pool, 0, sizeof(*pool));
+}
@@ -0,0 +1,36 @@
+#ifndef MIDICTL_STRPOOL_H
+#define MIDICTL_STRPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+	Interned strings stored back to back in one contiguous block.
+	Every distinct string is stored only once and is referred to by
+	its offset in the block. The block may move while strings are
+	being added, so pointers should only be taken once it's complete.
+*/
+typedef struct strpool
+{
+	char *data;       //!< The string block
+	size_t size;      //!< Used bytes
+	size_t capacity;  //!< Allocated bytes
+
+	uint32_t *table;  //!< Open addressing hash table of (offset + 1), 0 for empty slots
+	size_t table_size; //!< Number of slots (power of 2)
+	size_t count;     //!< Number of distinct strings
+} strpool;
+
+extern void strpool_init(strpool *pool);
+extern long strpool_intern(strpool *pool, const char *s, size_t len);
+extern void strpool_destroy(strpool *pool);
+
+/**
+	\returns pointer to an interned string
+*/
+static inline char *strpool_get(const strpool *pool, long offset)
+{
+	return pool->data + offset;
+}
+
+#endif
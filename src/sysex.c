@@ -0,0 +1,281 @@
+#include "sysex.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/**
+	\returns value of a hex digit
+*/
+static int hex_value(char c)
+{
+	return isdigit((unsigned char) c) ? c - '0' : tolower((unsigned char) c) - 'a' + 10;
+}
+
+/**
+	Checks if the token is a field keyword followed by its length,
+	e.g. 'addr4'
+
+	\returns the length or 0 if it's not the keyword (or the length is out of range)
+*/
+static int match_field(const char *tok, int len, const char *keyword, int max)
+{
+	int kw_len = strlen(keyword);
+	if (len != kw_len + 1 || strncmp(tok, keyword, kw_len) || !isdigit((unsigned char) tok[kw_len]))
+		return 0;
+
+	int n = tok[kw_len] - '0';
+	return n >= 1 && n <= max ? n : 0;
+}
+
+/**
+	Compiles a SysEx template. The template is a list of space separated
+	tokens - hex bytes (F0 ... F7) and fields:
+	 - addrN - N address bytes (7 bits each)
+	 - valN - the value in N bytes, 7 bits each
+	 - nibN - the value in N bytes, 4 bits each
+	 - sum - Roland checksum
+	 - xor - XOR checksum
+
+	\returns 0 on success
+*/
+int sysex_template_compile(sysex_template *t, const char *name, int name_len, const char *p, const char **errpos, const char **errstr)
+{
+	memset(t, 0, sizeof(*t));
+	t->addr_pos = -1;
+	t->value_pos = -1;
+	t->checksum_pos = -1;
+
+	// Errors about the whole template are reported at its start
+	const char *start = p + strspn(p, " \t");
+	while (1)
+	{
+		while (*p && isspace((unsigned char) *p))
+			p++;
+		if (!*p || *p == '#')
+			break;
+
+		const char *tok = p;
+		int len = strcspn(p, " \t\r\n#");
+		p += len;
+		*errpos = tok;
+
+		int n;
+		if (len == 2 && isxdigit((unsigned char) tok[0]) && isxdigit((unsigned char) tok[1]))
+		{
+			n = 1;
+			if (t->size < SYSEX_TEMPLATE_MAX)
+				t->bytes[t->size] = hex_value(tok[0]) << 4 | hex_value(tok[1]);
+		}
+		else if ((n = match_field(tok, len, "addr", 4)))
+		{
+			if (t->addr_pos >= 0)
+			{
+				*errstr = "Only one address field is allowed!";
+				return 1;
+			}
+			t->addr_pos = t->size;
+			t->addr_len = n;
+		}
+		else if ((n = match_field(tok, len, "val", 3)) || (n = match_field(tok, len, "nib", 4)))
+		{
+			if (t->value_pos >= 0)
+			{
+				*errstr = "Only one value field is allowed!";
+				return 1;
+			}
+			t->value_pos = t->size;
+			t->value_len = n;
+			t->encoding = tok[0] == 'v' ? SYSEX_VALUE_7BIT : SYSEX_VALUE_NIBBLES;
+		}
+		else if ((len == 3 && !strncmp(tok, "sum", 3)) || (len == 3 && !strncmp(tok, "xor", 3)))
+		{
+			if (t->checksum_pos >= 0)
+			{
+				*errstr = "Only one checksum is allowed!";
+				return 1;
+			}
+			n = 1;
+			t->checksum_pos = t->size;
+			t->checksum = tok[0] == 's' ? SYSEX_CHECKSUM_ROLAND : SYSEX_CHECKSUM_XOR;
+		}
+		else
+		{
+			*errstr = "Expected a hex byte, 'addrN', 'valN', 'nibN', 'sum' or 'xor'!";
+			return 1;
+		}
+
+		if (t->size + n > SYSEX_TEMPLATE_MAX)
+		{
+			*errstr = "SysEx template is too long!";
+			return 1;
+		}
+		t->size += n;
+	}
+
+	// Literal data bytes must be 7-bit
+	*errpos = start;
+	for (int i = 1; i < t->size - 1; i++)
+		if (t->bytes[i] & 0x80)
+		{
+			*errstr = "Only the first and the last byte can have the top bit set!";
+			return 1;
+		}
+
+	*errstr = NULL;
+	if (t->size < 3 || t->bytes[0] != 0xf0 || t->bytes[t->size - 1] != 0xf7 || t->addr_pos == 0 || t->value_pos == 0 || t->checksum_pos == 0)
+		*errstr = "SysEx template must start with F0 and end with F7!";
+	else if (t->value_pos < 0)
+		*errstr = "SysEx template has no value field!";
+	else if (t->checksum_pos >= 0 && (t->checksum_pos < t->value_pos || t->checksum_pos < t->addr_pos))
+		*errstr = "Checksum must follow the address and the value!";
+
+	if (*errstr)
+		return 1;
+
+	t->name = strndup(name, name_len);
+	if (!t->name)
+	{
+		*errstr = "Out of memory!";
+		return 1;
+	}
+	return 0;
+}
+
+/**
+	\returns highest value the template can carry (limited to 14 bits)
+*/
+int sysex_template_max(const sysex_template *t)
+{
+	int bits = t->value_len * (t->encoding == SYSEX_VALUE_NIBBLES ? 4 : 7);
+	return bits >= 14 ? 16383 : (1 << bits) - 1;
+}
+
+/**
+	Values of adjacent addresses can be merged into one message if
+	the value is the last field before the checksum (or F7) and
+	comes after the address.
+
+	\returns whether the template allows merging
+*/
+int sysex_template_mergeable(const sysex_template *t)
+{
+	int end = t->checksum_pos >= 0 ? t->checksum_pos : t->size - 1;
+	return t->addr_pos >= 0 && t->addr_pos < t->value_pos && t->value_pos + t->value_len == end;
+}
+
+/**
+	\returns whether the address fits the template's address field.
+		Addresses are written as hex bytes, e.g. 0x18000040.
+*/
+int sysex_addr_valid(const sysex_template *t, int addr)
+{
+	if (addr < 0 || (t->addr_len < 4 && addr >> (8 * t->addr_len)))
+		return 0;
+	return !(addr & 0x80808080);
+}
+
+/**
+	Addresses count in 7-bit bytes - 0x7f is followed by 0x100
+*/
+static int sysex_addr_to_linear(int addr)
+{
+	int lin = 0;
+	for (int i = 3; i >= 0; i--)
+		lin = lin * 128 + ((addr >> (8 * i)) & 127);
+	return lin;
+}
+
+static int sysex_addr_from_linear(int lin)
+{
+	int addr = 0;
+	for (int i = 0; i < 4; i++, lin >>= 7)
+		addr |= (lin & 127) << (8 * i);
+	return addr;
+}
+
+/**
+	\returns address of the n-th value after the one at addr
+		or -1 if it doesn't fit the address field
+*/
+int sysex_addr_offset(const sysex_template *t, int addr, int n)
+{
+	int next = sysex_addr_from_linear(sysex_addr_to_linear(addr) + n * t->value_len);
+	return sysex_addr_valid(t, next) ? next : -1;
+}
+
+/**
+	Finds the values and the checksum in a message carrying
+	given number of values
+*/
+void sysex_layout_init(sysex_layout *l, const sysex_template *t, int count)
+{
+	l->size = sysex_size(t, count);
+	l->value_pos = t->value_pos;
+	l->value_len = t->value_len;
+	l->bits = t->encoding == SYSEX_VALUE_NIBBLES ? 4 : 7;
+	l->checksum = t->checksum;
+	l->checksum_start = t->addr_pos >= 0 && t->addr_pos < t->value_pos ? t->addr_pos : t->value_pos;
+	l->checksum_pos = t->checksum_pos >= 0 ? t->checksum_pos + (count - 1) * t->value_len : -1;
+}
+
+/**
+	Puts n-th value in the message
+*/
+static void sysex_put_value(const sysex_layout *l, uint8_t *msg, int n, int value)
+{
+	uint8_t *v = msg + l->value_pos + n * l->value_len;
+	int mask = (1 << l->bits) - 1;
+	for (int j = l->value_len - 1; j >= 0; j--)
+		*v++ = (value >> (l->bits * j)) & mask;
+}
+
+/**
+	Computes the checksum of the message
+*/
+static void sysex_put_checksum(const sysex_layout *l, uint8_t *msg)
+{
+	if (l->checksum_pos < 0)
+		return;
+
+	int sum = 0;
+	for (int i = l->checksum_start; i < l->checksum_pos; i++)
+		sum = l->checksum == SYSEX_CHECKSUM_ROLAND ? sum + msg[i] : sum ^ msg[i];
+	msg[l->checksum_pos] = l->checksum == SYSEX_CHECKSUM_ROLAND ? (128 - (sum & 127)) & 127 : sum & 127;
+}
+
+/**
+	Builds a message with values for count adjacent addresses,
+	starting at addr (count has to be 1 unless the template is
+	mergeable). The message takes sysex_size() bytes.
+
+	\returns size of the message
+*/
+int sysex_build(const sysex_template *t, uint8_t *dst, int addr, const int16_t *values, int count)
+{
+	sysex_layout l;
+	sysex_layout_init(&l, t, count);
+
+	int tail = t->value_pos + t->value_len;
+	memcpy(dst, t->bytes, t->value_pos);
+	memcpy(dst + t->value_pos + count * t->value_len, t->bytes + tail, t->size - tail);
+	for (int i = 0; i < t->addr_len; i++)
+		dst[t->addr_pos + i] = (addr >> (8 * (t->addr_len - 1 - i))) & 127;
+
+	for (int i = 0; i < count; i++)
+		sysex_put_value(&l, dst, i, values[i]);
+	sysex_put_checksum(&l, dst);
+	return l.size;
+}
+
+/**
+	Replaces values in a message built with sysex_build()
+
+	\param values New values, negative ones leave the value in the message as it is
+*/
+void sysex_patch(const sysex_layout *l, uint8_t *msg, const int *values, int count)
+{
+	for (int i = 0; i < count; i++)
+		if (values[i] >= 0)
+			sysex_put_value(l, msg, i, values[i]);
+	sysex_put_checksum(l, msg);
+}
@@ -0,0 +1,87 @@
+#ifndef MIDICTL_SYSEX_H
+#define MIDICTL_SYSEX_H
+
+#include <stdint.h>
+
+/**
+	Longest SysEx template in bytes
+*/
+#define SYSEX_TEMPLATE_MAX 64
+
+/**
+	Most value bytes merged into one message
+*/
+#define SYSEX_MERGE_MAX 128
+
+/**
+	How the value is put in the message
+*/
+typedef enum sysex_encoding
+{
+	SYSEX_VALUE_7BIT,    //!< 7 bits per byte, MSB first
+	SYSEX_VALUE_NIBBLES, //!< 4 bits per byte, MSB first
+} sysex_encoding;
+
+/**
+	Checksum rule
+*/
+typedef enum sysex_checksum
+{
+	SYSEX_CHECKSUM_NONE,
+	SYSEX_CHECKSUM_ROLAND, //!< Sum of the covered bytes plus checksum is a multiple of 128
+	SYSEX_CHECKSUM_XOR,    //!< XOR of the covered bytes
+} sysex_checksum;
+
+/**
+	Compiled SysEx template. The message is prepared once and
+	only the address, value and checksum are patched when sending.
+	The checksum covers everything from the first address or value
+	byte up to the checksum byte.
+*/
+typedef struct sysex_template
+{
+	char *name;
+	uint8_t bytes[SYSEX_TEMPLATE_MAX]; //!< The message with zeros in place of address, value and checksum
+	int size;
+	int addr_pos;     //!< Position of the address bytes (-1 if none)
+	int addr_len;
+	int value_pos;    //!< Position of the value bytes
+	int value_len;
+	int encoding;     //!< sysex_encoding
+	int checksum_pos; //!< Position of the checksum byte (-1 if none)
+	int checksum;     //!< sysex_checksum
+} sysex_template;
+
+/**
+	Where the values and the checksum are in a message built from
+	a template, so the values can be replaced without the template
+*/
+typedef struct sysex_layout
+{
+	uint16_t size;          //!< Message size
+	uint8_t value_pos;      //!< Position of the first value
+	uint8_t value_len;      //!< Bytes per value
+	uint8_t bits;           //!< Bits per value byte
+	uint8_t checksum;       //!< sysex_checksum
+	uint8_t checksum_start; //!< First byte covered by the checksum
+	int16_t checksum_pos;   //!< Position of the checksum byte (-1 if none)
+} sysex_layout;
+
+extern int sysex_template_compile(sysex_template *t, const char *name, int name_len, const char *p, const char **errpos, const char **errstr);
+extern int sysex_template_max(const sysex_template *t);
+extern int sysex_template_mergeable(const sysex_template *t);
+extern int sysex_addr_valid(const sysex_template *t, int addr);
+extern int sysex_addr_offset(const sysex_template *t, int addr, int n);
+extern void sysex_layout_init(sysex_layout *l, const sysex_template *t, int count);
+extern int sysex_build(const sysex_template *t, uint8_t *dst, int addr, const int16_t *values, int count);
+extern void sysex_patch(const sysex_layout *l, uint8_t *msg, const int *values, int count);
+
+/**
+	\returns size of a message carrying given number of values
+*/
+static inline int sysex_size(const sysex_template *t, int count)
+{
+	return t->size + (count - 1) * t->value_len;
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include "utils.h"
 #include <ctype.h>
+#include <time.h>
 
 /**
 	\returns whether the string is only whitespace
@@ -34,4 +35,14 @@ void trim_r_whitespace(char *s)
 	p -= 1;
 	while (p >= s && isspace(*p))
 		*p-- = 0;
-}
\ No newline at end of file
+}
+
+/**
+	\returns CLOCK_MONOTONIC time in nanoseconds
+*/
+uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
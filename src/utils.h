@@ -6,8 +6,11 @@
 #define CLAMP(x, min, max) (MAX(MIN(x, (max)), (min)))
 #define INRANGE(x, min, max) (((x) <= (max)) && ((x) >= (min)))
 
+#include <stdint.h>
+
 extern int isempty(const char *s);
 extern void trim_newline(char *s);
 extern void trim_r_whitespace(char *s);
+extern uint64_t monotonic_ns(void);
 
 #endif
\ No newline at end of file